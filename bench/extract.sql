@@ -0,0 +1,47 @@
+-- Compare bulk extraction of the statement table through the view, the
+-- JSON document and the Arrow IPC stream.
+--
+-- Run against a server with pg_query_stats loaded:
+--   psql -X -f bench/extract.sql
+--
+-- Fill the table first (pg_query_stats.max_entries = 10000) so that each
+-- method moves the same 10000 rows.
+
+\set ON_ERROR_STOP on
+
+-- Distinct statement texts up to the table's capacity
+\o /dev/null
+SELECT pg_query_stats_reset();
+SELECT format('SELECT %s AS n', g) AS stmt
+FROM generate_series(1, current_setting('pg_query_stats.max_entries')::int) AS g \gexec
+\o
+
+\timing on
+
+\echo 'SELECT * FROM pg_query_stats'
+\o /dev/null
+SELECT * FROM pg_query_stats;
+SELECT * FROM pg_query_stats;
+SELECT * FROM pg_query_stats;
+\o
+
+\echo 'pg_query_stats_json()'
+\o /dev/null
+SELECT pg_query_stats_json();
+SELECT pg_query_stats_json();
+SELECT pg_query_stats_json();
+\o
+
+\echo 'pg_query_stats_arrow()'
+\o /dev/null
+SELECT pg_query_stats_arrow();
+SELECT pg_query_stats_arrow();
+SELECT pg_query_stats_arrow();
+\o
+
+\timing off
+
+SELECT count(*) AS entries,
+       pg_size_pretty(length(pg_query_stats_json()::text)::bigint) AS json_size,
+       pg_size_pretty(length(pg_query_stats_arrow())::bigint) AS arrow_size
+FROM pg_query_stats;
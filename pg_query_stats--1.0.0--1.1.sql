@@ -0,0 +1,779 @@
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_query_stats UPDATE TO '1.1'" to load this file. \quit
+
+-- pg_query_stats gained a leading queryid column
+DROP VIEW pg_query_stats;
+
+CREATE VIEW pg_query_stats AS
+SELECT 
+    queryid::bigint,
+    query_text::text,
+    calls::bigint,
+    total_time::double precision AS total_time_ms,
+    (total_time/calls)::double precision AS avg_time_ms,
+    min_time::double precision AS min_time_ms,
+    max_time::double precision AS max_time_ms
+FROM pg_query_stats() AS (
+    query_text text,
+    calls bigint,
+    total_time double precision,
+    min_time double precision,
+    max_time double precision,
+    queryid bigint
+);
+
+CREATE FUNCTION pg_query_stats_plan_nodes()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_plan_nodes'
+LANGUAGE C STRICT;
+
+CREATE VIEW pg_query_stats_plan_nodes AS
+SELECT
+    d.datname AS database,
+    s.node_type::text,
+    CASE WHEN s.relid <> 0 AND d.datname = current_database()
+         THEN s.relid::regclass END AS relation,
+    s.calls::bigint,
+    s.loops::bigint,
+    s.total_time::double precision AS total_time_ms,
+    (100.0 * s.total_time / NULLIF(sum(s.total_time) OVER (), 0))::double precision AS pct_time,
+    s.rows::double precision,
+    (s.sum_qerror / s.calls)::double precision AS avg_qerror,
+    s.max_qerror::double precision
+FROM pg_query_stats_plan_nodes() AS s (
+    dbid oid,
+    relid oid,
+    node_type text,
+    calls bigint,
+    loops bigint,
+    total_time double precision,
+    rows double precision,
+    sum_qerror double precision,
+    max_qerror double precision
+)
+LEFT JOIN pg_database d ON d.oid = s.dbid;
+
+CREATE FUNCTION pg_query_stats_estimates()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_estimates'
+LANGUAGE C STRICT;
+
+-- Statements ranked by their worst row estimate (q-error) on sampled runs
+CREATE VIEW pg_query_stats_estimates AS
+SELECT
+    queryid::bigint,
+    query_text::text,
+    calls::bigint,
+    sampled_calls::bigint,
+    (sum_qerror / sampled_calls)::double precision AS avg_qerror,
+    max_qerror::double precision
+FROM pg_query_stats_estimates() AS (
+    queryid bigint,
+    query_text text,
+    calls bigint,
+    sampled_calls bigint,
+    sum_qerror double precision,
+    max_qerror double precision
+)
+WHERE sampled_calls > 0
+ORDER BY max_qerror DESC;
+
+-- Relations ranked by the q-error of the plan nodes scanning them
+CREATE VIEW pg_query_stats_relation_estimates AS
+SELECT
+    database,
+    relation,
+    sum(calls)::bigint AS scans,
+    (sum(avg_qerror * calls) / sum(calls))::double precision AS avg_qerror,
+    max(max_qerror)::double precision AS max_qerror
+FROM pg_query_stats_plan_nodes
+WHERE relation IS NOT NULL
+GROUP BY database, relation
+ORDER BY max_qerror DESC;
+
+CREATE FUNCTION pg_query_stats_spills()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_spills'
+LANGUAGE C STRICT;
+
+-- Statements that spilled sorts or hashes to temp files
+CREATE VIEW pg_query_stats_spills AS
+SELECT
+    queryid::bigint,
+    query_text::text,
+    calls::bigint,
+    spill_calls::bigint,
+    temp_blks_read::bigint,
+    temp_blks_written::bigint,
+    pg_size_pretty(temp_blks_written * current_setting('block_size')::bigint) AS temp_written,
+    sampled_calls::bigint,
+    pg_size_pretty(peak_mem_kb * 1024) AS peak_mem,
+    suggested_work_mem_kb::bigint,
+    pg_size_pretty(suggested_work_mem_kb * 1024) AS suggested_work_mem
+FROM pg_query_stats_spills() AS (
+    queryid bigint,
+    query_text text,
+    calls bigint,
+    spill_calls bigint,
+    temp_blks_read bigint,
+    temp_blks_written bigint,
+    sampled_calls bigint,
+    peak_mem_kb bigint,
+    suggested_work_mem_kb bigint
+)
+WHERE spill_calls > 0
+ORDER BY temp_blks_written DESC;
+
+CREATE FUNCTION pg_query_stats_seq_scans()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_seq_scans'
+LANGUAGE C STRICT;
+
+CREATE VIEW pg_query_stats_seq_scans AS
+SELECT
+    d.datname AS database,
+    s.relid::oid,
+    s.attnums::smallint[],
+    s.calls::bigint,
+    s.rows_returned::double precision,
+    s.rows_removed::double precision,
+    s.total_time::double precision AS total_time_ms
+FROM pg_query_stats_seq_scans() AS s (
+    dbid oid,
+    relid oid,
+    attnums smallint[],
+    calls bigint,
+    rows_returned double precision,
+    rows_removed double precision,
+    total_time double precision
+)
+LEFT JOIN pg_database d ON d.oid = s.dbid;
+
+-- Filtered Seq Scans in the current database whose filter keeps at most
+-- 10% of the rows, ranked by the scan time an index could have skipped
+CREATE VIEW pg_query_stats_index_candidates AS
+SELECT
+    s.relid::regclass AS relation,
+    c.columns,
+    s.calls AS seq_scans,
+    s.rows_returned,
+    s.rows_removed,
+    (s.rows_returned / NULLIF(s.rows_returned + s.rows_removed, 0))::double precision AS selectivity,
+    s.total_time_ms,
+    (s.total_time_ms * s.rows_removed / NULLIF(s.rows_returned + s.rows_removed, 0))::double precision AS est_savings_ms,
+    format('CREATE INDEX ON %s (%s)', s.relid::regclass, array_to_string(c.columns, ', ')) AS suggestion
+FROM pg_query_stats_seq_scans s
+CROSS JOIN LATERAL (
+    SELECT array_agg(quote_ident(a.attname) ORDER BY k.ord) AS columns
+    FROM unnest(s.attnums) WITH ORDINALITY AS k(attnum, ord)
+    JOIN pg_attribute a ON a.attrelid = s.relid AND a.attnum = k.attnum
+) c
+WHERE s.database = current_database()
+  AND c.columns IS NOT NULL
+  AND s.rows_returned <= 0.1 * (s.rows_returned + s.rows_removed)
+ORDER BY est_savings_ms DESC;
+
+CREATE FUNCTION pg_query_stats_parallel()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_parallel'
+LANGUAGE C STRICT;
+
+-- Parallel plans: worker launch success and, on sampled executions, how
+-- much of the work below Gather ran in workers and the effective speedup
+CREATE VIEW pg_query_stats_parallel AS
+SELECT
+    queryid::bigint,
+    query_text::text,
+    calls::bigint,
+    total_time::double precision AS total_time_ms,
+    parallel_calls::bigint,
+    workers_planned::bigint,
+    workers_launched::bigint,
+    (workers_launched::double precision / NULLIF(workers_planned, 0)) AS launch_ratio,
+    leader_time::double precision AS leader_time_ms,
+    worker_time::double precision AS worker_time_ms,
+    ((leader_time + worker_time) / NULLIF(gather_time, 0))::double precision AS speedup
+FROM pg_query_stats_parallel() AS (
+    queryid bigint,
+    query_text text,
+    calls bigint,
+    total_time double precision,
+    parallel_calls bigint,
+    workers_planned bigint,
+    workers_launched bigint,
+    leader_time double precision,
+    worker_time double precision,
+    gather_time double precision
+)
+WHERE parallel_calls > 0
+ORDER BY total_time DESC;
+
+CREATE FUNCTION pg_query_stats_jit()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_jit'
+LANGUAGE C STRICT;
+
+-- JIT compilation cost against the execution time of the runs that used it
+CREATE VIEW pg_query_stats_jit AS
+SELECT
+    queryid::bigint,
+    query_text::text,
+    calls::bigint,
+    jit_calls::bigint,
+    jit_functions::bigint,
+    jit_generation_time::double precision AS jit_generation_time_ms,
+    jit_deform_time::double precision AS jit_deform_time_ms,
+    jit_inlining_time::double precision AS jit_inlining_time_ms,
+    jit_optimization_time::double precision AS jit_optimization_time_ms,
+    jit_emission_time::double precision AS jit_emission_time_ms,
+    (jit_generation_time + jit_inlining_time + jit_optimization_time +
+     jit_emission_time)::double precision AS jit_total_time_ms,
+    jit_exec_time::double precision AS jit_exec_time_ms,
+    ((jit_generation_time + jit_inlining_time + jit_optimization_time +
+      jit_emission_time) / NULLIF(jit_exec_time, 0))::double precision AS jit_time_ratio
+FROM pg_query_stats_jit() AS (
+    queryid bigint,
+    query_text text,
+    calls bigint,
+    jit_calls bigint,
+    jit_exec_time double precision,
+    jit_functions bigint,
+    jit_generation_time double precision,
+    jit_deform_time double precision,
+    jit_inlining_time double precision,
+    jit_optimization_time double precision,
+    jit_emission_time double precision
+)
+WHERE jit_calls > 0
+ORDER BY jit_time_ratio DESC;
+
+CREATE FUNCTION pg_query_stats_plan_cache()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_plan_cache'
+LANGUAGE C STRICT;
+
+-- Prepared statements executed with both generic and custom plans, with a
+-- plan_cache_mode suggestion when one kind is clearly slower (>20%)
+CREATE VIEW pg_query_stats_plan_cache AS
+SELECT
+    queryid,
+    query_text,
+    calls,
+    generic_calls,
+    (generic_time / NULLIF(generic_calls, 0))::double precision AS avg_generic_time_ms,
+    custom_calls,
+    (custom_time / NULLIF(custom_calls, 0))::double precision AS avg_custom_time_ms,
+    CASE
+        WHEN generic_calls = 0 OR custom_calls = 0 THEN NULL
+        WHEN generic_time / generic_calls > 1.2 * custom_time / custom_calls
+            THEN 'force_custom_plan'
+        WHEN custom_time / custom_calls > 1.2 * generic_time / generic_calls
+            THEN 'force_generic_plan'
+    END AS suggested_plan_cache_mode
+FROM pg_query_stats_plan_cache() AS (
+    queryid bigint,
+    query_text text,
+    calls bigint,
+    generic_calls bigint,
+    generic_time double precision,
+    custom_calls bigint,
+    custom_time double precision
+)
+WHERE generic_calls > 0 OR custom_calls > 0
+ORDER BY generic_time + custom_time DESC;
+
+CREATE FUNCTION pg_query_stats_waits()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_waits'
+LANGUAGE C STRICT;
+
+-- Wait profile per statement from the wait sampler; samples taken while the
+-- backend was not waiting are reported as CPU
+CREATE VIEW pg_query_stats_waits AS
+SELECT
+    w.queryid,
+    q.query_text,
+    coalesce(w.wait_event_type, 'CPU') AS wait_event_type,
+    coalesce(w.wait_event, 'CPU') AS wait_event,
+    w.samples,
+    w.time AS est_time_ms,
+    (100.0 * w.samples / sum(w.samples) OVER (PARTITION BY w.queryid))::double precision AS pct
+FROM pg_query_stats_waits() AS w (
+    queryid bigint,
+    wait_event_type text,
+    wait_event text,
+    samples bigint,
+    time double precision
+)
+LEFT JOIN pg_query_stats q ON q.queryid = w.queryid
+ORDER BY w.queryid, w.samples DESC;
+
+CREATE FUNCTION pg_query_stats_active()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_active'
+LANGUAGE C STRICT;
+
+-- Statements currently executing, one row per backend, with the number of
+-- backends running the same statement right now
+CREATE VIEW pg_query_stats_active AS
+SELECT
+    a.pid,
+    d.datname AS database,
+    a.queryid,
+    q.query_text,
+    a.nesting_level,
+    a.start_time,
+    (extract(epoch FROM clock_timestamp() - a.start_time) * 1000)::double precision AS elapsed_ms,
+    count(*) OVER (PARTITION BY a.queryid) AS concurrency
+FROM pg_query_stats_active() AS a (
+    pid integer,
+    dbid oid,
+    queryid bigint,
+    nesting_level integer,
+    start_time timestamp with time zone
+)
+LEFT JOIN pg_database d ON d.oid = a.dbid
+LEFT JOIN pg_query_stats q ON q.queryid = a.queryid
+ORDER BY a.start_time;
+
+CREATE FUNCTION pg_query_stats_concurrency()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_concurrency'
+LANGUAGE C STRICT;
+
+-- Concurrency of each statement at its start, with a histogram of starts
+-- and mean latency per concurrency bucket
+CREATE VIEW pg_query_stats_concurrency AS
+SELECT
+    queryid,
+    query_text,
+    calls,
+    inflight,
+    peak_concurrency,
+    (concurrency_sum::double precision / NULLIF(concurrency_starts, 0)) AS avg_concurrency,
+    ARRAY['1', '2', '3-4', '5-8', '9-16', '17-32', '33-64', '65+'] AS hist_bounds,
+    hist_calls,
+    ARRAY(SELECT u.t / NULLIF(u.c, 0)
+          FROM unnest(hist_calls, hist_time) AS u(c, t)) AS hist_avg_time_ms
+FROM pg_query_stats_concurrency() AS (
+    queryid bigint,
+    query_text text,
+    calls bigint,
+    inflight integer,
+    peak_concurrency integer,
+    concurrency_starts bigint,
+    concurrency_sum bigint,
+    hist_calls bigint[],
+    hist_time double precision[]
+)
+WHERE concurrency_starts > 0
+ORDER BY peak_concurrency DESC;
+
+CREATE FUNCTION pg_query_stats_client_send()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_client_send'
+LANGUAGE C STRICT;
+
+-- Execution time split into compute and sending rows to the client
+CREATE VIEW pg_query_stats_client_send AS
+SELECT
+    queryid,
+    query_text,
+    calls,
+    send_calls,
+    (send_exec_time - send_time)::double precision AS compute_time_ms,
+    send_time::double precision AS send_time_ms,
+    (send_time / NULLIF(send_exec_time, 0))::double precision AS send_ratio,
+    rows_sent,
+    bytes_sent,
+    pg_size_pretty(bytes_sent) AS sent
+FROM pg_query_stats_client_send() AS (
+    queryid bigint,
+    query_text text,
+    calls bigint,
+    send_calls bigint,
+    send_exec_time double precision,
+    send_time double precision,
+    rows_sent bigint,
+    bytes_sent bigint
+)
+WHERE send_calls > 0
+ORDER BY send_time DESC;
+
+CREATE FUNCTION pg_query_stats_xacts()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_xacts'
+LANGUAGE C STRICT;
+
+-- Transactions aggregated per shape: the sequence of statements they ran
+CREATE VIEW pg_query_stats_xacts AS
+SELECT
+    d.datname AS database,
+    x.xact_fingerprint,
+    x.nstatements,
+    x.statements,
+    (SELECT string_agg(coalesce(q.query_text, u.queryid::text), E';\n' ORDER BY u.ord)
+     FROM unnest(x.statements) WITH ORDINALITY AS u(queryid, ord)
+     LEFT JOIN pg_query_stats q ON q.queryid = u.queryid) AS shape,
+    x.calls,
+    x.commits,
+    x.aborts,
+    x.total_time AS total_time_ms,
+    (x.total_time / x.calls)::double precision AS avg_time_ms,
+    x.min_time AS min_time_ms,
+    x.max_time AS max_time_ms,
+    (x.commit_time / NULLIF(x.commits, 0))::double precision AS avg_commit_time_ms,
+    x.serialization_failures,
+    x.deadlocks,
+    x.retries,
+    x.retry_wasted_time AS retry_wasted_time_ms
+FROM pg_query_stats_xacts() AS x (
+    dbid oid,
+    xact_fingerprint bigint,
+    nstatements integer,
+    statements bigint[],
+    calls bigint,
+    commits bigint,
+    aborts bigint,
+    total_time double precision,
+    min_time double precision,
+    max_time double precision,
+    commit_time double precision,
+    serialization_failures bigint,
+    deadlocks bigint,
+    retries bigint,
+    retry_wasted_time double precision
+)
+LEFT JOIN pg_database d ON d.oid = x.dbid
+ORDER BY x.total_time DESC;
+
+CREATE FUNCTION pg_query_stats_repeats()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_repeats'
+LANGUAGE C STRICT;
+
+-- Statements executed repeatedly within the same transaction (N+1 and
+-- chatty transaction patterns), ranked by the round trips beyond one per
+-- transaction
+CREATE VIEW pg_query_stats_repeats AS
+SELECT
+    queryid,
+    query_text,
+    calls,
+    total_time AS total_time_ms,
+    xacts,
+    xact_calls AS round_trips,
+    (xact_calls::double precision / xacts) AS avg_calls_per_xact,
+    max_xact_calls AS max_calls_per_xact,
+    (xact_statements::double precision / xacts) AS avg_xact_statements,
+    (xact_calls - xacts) AS extra_round_trips
+FROM pg_query_stats_repeats() AS (
+    queryid bigint,
+    query_text text,
+    calls bigint,
+    total_time double precision,
+    xacts bigint,
+    xact_calls bigint,
+    max_xact_calls bigint,
+    xact_statements bigint
+)
+WHERE xacts > 0 AND xact_calls > xacts
+ORDER BY extra_round_trips DESC;
+
+CREATE FUNCTION pg_query_stats_xact_gaps()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_xact_gaps'
+LANGUAGE C STRICT;
+
+-- Client think-time inside transactions: gaps between statements and idle
+-- time before the transaction ends, per shape and application
+CREATE VIEW pg_query_stats_xact_gaps AS
+SELECT
+    d.datname AS database,
+    g.xact_fingerprint,
+    g.application_name,
+    g.xacts,
+    g.xact_time AS xact_time_ms,
+    g.gaps,
+    g.gap_time AS gap_time_ms,
+    (g.gap_time / NULLIF(g.gaps, 0))::double precision AS avg_gap_ms,
+    g.max_gap AS max_gap_ms,
+    g.idle_time AS idle_before_end_ms,
+    ((g.gap_time + g.idle_time) / NULLIF(g.xact_time, 0))::double precision AS client_time_fraction
+FROM pg_query_stats_xact_gaps() AS g (
+    dbid oid,
+    xact_fingerprint bigint,
+    application_name text,
+    xacts bigint,
+    xact_time double precision,
+    gaps bigint,
+    gap_time double precision,
+    max_gap double precision,
+    idle_time double precision
+)
+LEFT JOIN pg_database d ON d.oid = g.dbid
+ORDER BY g.gap_time + g.idle_time DESC;
+
+CREATE FUNCTION pg_query_stats_sessions()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_sessions'
+LANGUAGE C STRICT;
+
+-- Totals of the top-level statements of each connected session
+CREATE VIEW pg_query_stats_sessions AS
+SELECT
+    pid,
+    application_name,
+    client_addr,
+    session_start,
+    statements,
+    total_time AS total_time_ms,
+    rows,
+    shared_blks_hit,
+    shared_blks_read,
+    shared_blks_written
+FROM pg_query_stats_sessions() AS (
+    pid integer,
+    application_name text,
+    client_addr text,
+    session_start timestamp with time zone,
+    statements bigint,
+    total_time double precision,
+    rows bigint,
+    shared_blks_hit bigint,
+    shared_blks_read bigint,
+    shared_blks_written bigint
+)
+ORDER BY total_time DESC;
+
+CREATE FUNCTION pg_query_stats_applications()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_applications'
+LANGUAGE C STRICT;
+
+-- Per application and client address: ended sessions rolled up at exit
+-- plus the sessions still connected
+CREATE VIEW pg_query_stats_applications AS
+SELECT
+    application_name,
+    client_addr,
+    sum(sessions)::bigint AS sessions,
+    sum(active_sessions)::bigint AS active_sessions,
+    sum(statements)::bigint AS statements,
+    sum(total_time) AS total_time_ms,
+    sum(rows)::bigint AS rows,
+    sum(shared_blks_hit)::bigint AS shared_blks_hit,
+    sum(shared_blks_read)::bigint AS shared_blks_read,
+    sum(shared_blks_written)::bigint AS shared_blks_written
+FROM (
+    SELECT application_name, client_addr, sessions, 0 AS active_sessions,
+           statements, total_time, rows,
+           shared_blks_hit, shared_blks_read, shared_blks_written
+    FROM pg_query_stats_applications() AS (
+        application_name text,
+        client_addr text,
+        sessions bigint,
+        session_time double precision,
+        statements bigint,
+        total_time double precision,
+        rows bigint,
+        shared_blks_hit bigint,
+        shared_blks_read bigint,
+        shared_blks_written bigint
+    )
+    UNION ALL
+    SELECT application_name, client_addr, 1, 1,
+           statements, total_time_ms, rows,
+           shared_blks_hit, shared_blks_read, shared_blks_written
+    FROM pg_query_stats_sessions
+) AS s
+GROUP BY application_name, client_addr
+ORDER BY total_time_ms DESC;
+
+CREATE FUNCTION pg_query_stats_failures()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_failures'
+LANGUAGE C STRICT;
+
+-- Executions ended by an error, per statement and SQLSTATE, with the time
+-- spent before the failure.  The SQLSTATE comes from the server log report:
+-- it is NULL (kind 'unknown') when log_min_messages is above error or the
+-- error was caught by a PL/pgSQL exception block.
+CREATE VIEW pg_query_stats_failures AS
+SELECT
+    queryid,
+    query_text,
+    sqlstate,
+    left(sqlstate, 2) AS sqlstate_class,
+    CASE
+        WHEN sqlstate = '57014' THEN 'canceled'
+        WHEN sqlstate = '40001' THEN 'serialization_failure'
+        WHEN sqlstate = '40P01' THEN 'deadlock'
+        WHEN sqlstate = '55P03' THEN 'lock_not_available'
+        WHEN sqlstate = '25P03' THEN 'idle_in_transaction_timeout'
+        WHEN sqlstate IS NULL THEN 'unknown'
+        ELSE 'error'
+    END AS kind,
+    failures,
+    total_time AS total_time_ms,
+    (total_time / failures)::double precision AS avg_time_ms,
+    max_time AS max_time_ms
+FROM pg_query_stats_failures() AS (
+    queryid bigint,
+    query_text text,
+    sqlstate text,
+    failures bigint,
+    total_time double precision,
+    max_time double precision
+)
+ORDER BY total_time DESC;
+
+CREATE FUNCTION pg_query_stats_relations()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_relations'
+LANGUAGE C STRICT;
+
+-- Executor time and shared buffers per relation, each execution split
+-- evenly between the relations it references
+CREATE VIEW pg_query_stats_relations AS
+SELECT
+    d.datname AS database,
+    r.relid,
+    CASE WHEN r.dbid = (SELECT oid FROM pg_database WHERE datname = current_database())
+         THEN r.relid::regclass::text END AS relation,
+    r.calls,
+    r.total_time AS total_time_ms,
+    r.shared_blks_hit,
+    r.shared_blks_read,
+    r.shared_blks_dirtied,
+    r.shared_blks_written
+FROM pg_query_stats_relations() AS r (
+    dbid oid,
+    relid oid,
+    calls bigint,
+    total_time double precision,
+    shared_blks_hit double precision,
+    shared_blks_read double precision,
+    shared_blks_dirtied double precision,
+    shared_blks_written double precision
+)
+LEFT JOIN pg_database d ON d.oid = r.dbid
+ORDER BY r.total_time DESC;
+
+CREATE FUNCTION pg_query_stats_indexes()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_indexes'
+LANGUAGE C STRICT;
+
+-- Statements whose plans use each index of the current database: the
+-- statements affected if the index were dropped
+CREATE VIEW pg_query_stats_index_usage AS
+SELECT
+    i.indexid::regclass AS index,
+    x.indrelid::regclass AS relation,
+    i.queryid,
+    q.query_text,
+    i.calls,
+    i.total_time AS total_time_ms
+FROM pg_query_stats_indexes() AS i (
+    dbid oid,
+    indexid oid,
+    queryid bigint,
+    calls bigint,
+    total_time double precision
+)
+JOIN pg_index x ON x.indexrelid = i.indexid
+LEFT JOIN pg_query_stats q ON q.queryid = i.queryid
+WHERE i.dbid = (SELECT oid FROM pg_database WHERE datname = current_database())
+ORDER BY i.indexid, i.total_time DESC;
+
+CREATE FUNCTION pg_query_stats_workload()
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_workload'
+LANGUAGE C STRICT;
+
+-- Workload mix of top-level statements by command type, utility command
+-- tag and database, from counters that are never evicted
+CREATE VIEW pg_query_stats_workload AS
+SELECT
+    w.kind,
+    coalesce(w.name, d.datname, w.dbid::text) AS name,
+    w.calls,
+    w.total_time AS total_time_ms,
+    (w.total_time / w.calls)::double precision AS avg_time_ms,
+    (w.total_time / NULLIF(sum(w.total_time) OVER (PARTITION BY w.kind), 0))::double precision AS time_fraction
+FROM pg_query_stats_workload() AS w (
+    kind text,
+    name text,
+    dbid oid,
+    calls bigint,
+    total_time double precision
+)
+LEFT JOIN pg_database d ON d.oid = w.dbid
+ORDER BY w.kind, w.total_time DESC;
+
+-- The statement table as one versioned, compressed bytea
+CREATE FUNCTION pg_query_stats_export()
+RETURNS bytea
+AS 'pg_query_stats', 'pg_query_stats_export'
+LANGUAGE C STRICT;
+
+-- One row per statement across several exports, e.g. from many servers
+CREATE FUNCTION pg_query_stats_merge(
+    exports bytea[],
+    OUT queryid bigint,
+    OUT query_text text,
+    OUT sources integer,
+    OUT calls bigint,
+    OUT total_time double precision,
+    OUT min_time double precision,
+    OUT max_time double precision,
+    OUT temp_blks_read bigint,
+    OUT temp_blks_written bigint,
+    OUT hist_calls bigint[],
+    OUT hist_time double precision[]
+)
+RETURNS SETOF record
+AS 'pg_query_stats', 'pg_query_stats_merge'
+LANGUAGE C STRICT;
+
+-- Exports are decoded in C; only trusted roles may feed them in
+REVOKE ALL ON FUNCTION pg_query_stats_merge(bytea[]) FROM PUBLIC;
+
+-- The statement table as one JSON array, for bulk extraction
+CREATE FUNCTION pg_query_stats_json()
+RETURNS json
+AS 'pg_query_stats', 'pg_query_stats_json'
+LANGUAGE C STRICT;
+
+-- The statement table as an Arrow IPC stream (queryid, calls, total_time,
+-- min_time, max_time, query_text)
+CREATE FUNCTION pg_query_stats_arrow()
+RETURNS bytea
+AS 'pg_query_stats', 'pg_query_stats_arrow'
+LANGUAGE C STRICT;
+
+-- Workload capture: statements queued for the capture writer, and those
+-- dropped because its queue was full (NULL when capture is not configured)
+CREATE FUNCTION pg_query_stats_capture_info(
+    OUT captured bigint,
+    OUT dropped bigint
+)
+RETURNS record
+AS 'pg_query_stats', 'pg_query_stats_capture_info'
+LANGUAGE C STRICT;
+
+-- Statement table usage and the space saved by the shared text store
+CREATE FUNCTION pg_query_stats_info(
+    OUT entries integer,
+    OUT max_entries integer,
+    OUT texts integer,
+    OUT text_bytes bigint,
+    OUT stored_bytes bigint,
+    OUT bytes_saved bigint,
+    OUT text_store_size bigint,
+    OUT texts_truncated bigint
+)
+RETURNS record
+AS 'pg_query_stats', 'pg_query_stats_info'
+LANGUAGE C STRICT;
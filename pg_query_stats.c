@@ -1,6 +1,10 @@
 /* pg_query_stats.c - PostgreSQL Query Performance Monitor Extension */
 
 #include "postgres.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
 #include "fmgr.h"
 #include "funcapi.h"
 #include "miscadmin.h"
@@ -12,6 +16,44 @@
 #include "utils/guc.h"
 #include "storage/ipc.h"
 #include "nodes/pg_list.h"
+#include "nodes/nodeFuncs.h"
+#include "executor/instrument.h"
+#include "common/pg_prng.h"
+#include "utils/rel.h"
+#include "common/hashfn.h"
+#include "utils/tuplesort.h"
+#include "utils/array.h"
+#include "catalog/pg_type.h"
+#include "access/sysattr.h"
+#include "optimizer/optimizer.h"
+#include "jit/jit.h"
+#include "tcop/pquery.h"
+#include "utils/plancache.h"
+#include "commands/prepare.h"
+#include "utils/wait_event.h"
+#include "access/xact.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "tcop/tcopprot.h"
+#include "port/pg_bitutils.h"
+#include "access/detoast.h"
+#include "access/parallel.h"
+#include "libpq/libpq-be.h"
+#include "common/ip.h"
+#include "tcop/utility.h"
+#include "tcop/cmdtag.h"
+#include "lib/stringinfo.h"
+#include "utils/memutils.h"
+#include "libpq/pqformat.h"
+#include "common/pg_lzcompress.h"
+#include "utils/json.h"
+#include "utils/lsyscache.h"
+#include "storage/fd.h"
+#include "utils/hsearch.h"
+#include "access/transam.h"
+#include "mb/pg_wchar.h"
 
 PG_MODULE_MAGIC;
 
@@ -19,49 +61,691 @@ PG_MODULE_MAGIC;
 static bool pgqs_enabled = true;
 static int pgqs_max_entries = 100;
 static double pgqs_min_duration = 0.0;
-#define MAX_QUERY_LENGTH 1024
+static double pgqs_plan_sample_rate = 0.0;
+static bool pgqs_wait_sampling = false;
+static int pgqs_wait_sample_interval = 10;
+static bool pgqs_track_client_send = false;
+static int pgqs_retry_window = 1000;
+static bool pgqs_track_relations = false;
+static bool pgqs_track_indexes = false;
+static char *pgqs_exporter_listen = NULL;
+static int pgqs_exporter_top_n = 50;
+static char *pgqs_capture_directory = NULL;
+static bool pgqs_capture = false;
+static int pgqs_capture_file_size = 64;
+static int pgqs_capture_max_files = 16;
+#define MAX_QUERY_LENGTH 1024           /* stored (compressed) text provisioned per entry */
+#define MAX_QUERY_TEXT_LENGTH 4096      /* longest statement text kept */
+#define MAX_PLAN_NODE_ENTRIES 1000
+#define MAX_SEQ_SCAN_ENTRIES 1000
+#define MAX_FILTER_COLUMNS 8
+#define MAX_WAIT_ENTRIES 2000
+#define CONCURRENCY_BUCKETS 8     /* 1, 2, 3-4, 5-8, ..., 65+ */
+#define MAX_XACT_ENTRIES 1000
+#define XACT_SHAPE_STATEMENTS 16  /* statements kept to show a shape */
+#define XACT_DISTINCT_STATEMENTS 64 /* distinct statements counted per xact */
+#define MAX_XACT_GAP_ENTRIES 1000
+#define MAX_APPLICATION_ENTRIES 1000
+#define CLIENT_ADDR_LENGTH 64
+#define MAX_FAILURE_ENTRIES 1000
+#define MAX_RELATION_ENTRIES 2000
+#define MAX_INDEX_ENTRIES 2000
+#define MAX_DATABASE_COUNTERS 64
+#define PGQS_NUM_CMDTYPES (CMD_NOTHING + 1)
+
+/* pg_query_stats_export() format */
+#define PGQS_EXPORT_MAGIC 0x50475153    /* "PGQS" */
+#define PGQS_EXPORT_VERSION 1
+#define PGQS_EXPORT_PGLZ 0x0001         /* payload is pglz-compressed */
+#define PGQS_EXPORT_HEADER_SIZE 28
+#define PGQS_EXPORT_MIN_RECORD_SIZE (7 * 8 + CONCURRENCY_BUCKETS * 16 + 2)
+
+/* Arrow IPC constants, from Arrow's Schema.fbs and Message.fbs */
+#define ARROW_METADATA_V5 4
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_RECORD_BATCH 3
+#define ARROW_TYPE_INT 2
+#define ARROW_TYPE_FLOATING_POINT 3
+#define ARROW_TYPE_UTF8 5
+#define ARROW_PRECISION_DOUBLE 2
+#define ARROW_NUM_COLUMNS 6
+
+/* Workload capture */
+#define CAPTURE_QUEUE_SIZE 2048         /* power of two */
+#define CAPTURE_PARAMS_LENGTH 1024
+#define CAPTURE_FILE_MAGIC "PGQSCAP1"
+#define CAPTURE_FILE_VERSION 1
+
+/* LWLocks in the "pg_query_stats" named tranche */
+typedef enum pgqsLockId {
+    PGQS_LOCK_ENTRIES = 0,
+    PGQS_LOCK_PLAN_NODES,
+    PGQS_LOCK_SEQ_SCANS,
+    PGQS_LOCK_WAITS,
+    PGQS_LOCK_XACTS,
+    PGQS_LOCK_XACT_GAPS,
+    PGQS_LOCK_APPLICATIONS,
+    PGQS_LOCK_FAILURES,
+    PGQS_LOCK_RELATIONS,
+    PGQS_LOCK_INDEXES,
+    PGQS_LOCK_TEXTS,
+    PGQS_NUM_LOCKS
+} pgqsLockId;
 
 /* Query Stat Entry */
 typedef struct QueryStatEntry {
-    char query_text[MAX_QUERY_LENGTH];
+    uint64 queryid;             /* fingerprint of the statement text */
+    int text_id;                /* in the text store, -1 if not stored */
     uint64 calls;
     double total_time;
     double min_time;
     double max_time;
+    uint64 sampled_calls;       /* executions with plan instrumentation */
+    double sum_qerror;          /* sum of per-execution worst q-error */
+    double max_qerror;
+    int64 temp_blks_read;
+    int64 temp_blks_written;
+    uint64 spill_calls;         /* executions that spilled to temp files */
+    int64 peak_mem_kb;          /* largest sort/hash memory seen */
+    int64 suggested_work_mem_kb; /* work_mem that would avoid the spills */
+    uint64 parallel_calls;      /* executions with a Gather or Gather Merge */
+    int64 workers_planned;
+    int64 workers_launched;
+    double leader_time;         /* time below Gather spent in the leader */
+    double worker_time;         /* time below Gather spent in workers */
+    double gather_time;         /* elapsed time of the Gather nodes */
+    uint64 jit_calls;           /* executions that JIT-compiled code */
+    double jit_exec_time;       /* total time of those executions */
+    int64 jit_functions;
+    double jit_generation_time;
+    double jit_deform_time;     /* part of generation time, PG 17+ */
+    double jit_inlining_time;
+    double jit_optimization_time;
+    double jit_emission_time;
+    uint64 generic_calls;       /* executions of a generic cached plan */
+    double generic_time;
+    uint64 custom_calls;        /* executions of a custom cached plan */
+    double custom_time;
+    /* Concurrency, maintained with atomics under the shared lock */
+    pg_atomic_uint32 inflight;  /* executions running right now */
+    pg_atomic_uint32 peak_concurrency;
+    pg_atomic_uint64 concurrency_starts;
+    pg_atomic_uint64 concurrency_sum; /* concurrency seen at each start */
+    pg_atomic_uint64 concurrency_hist[CONCURRENCY_BUCKETS];
+    double concurrency_hist_time[CONCURRENCY_BUCKETS]; /* under exclusive lock */
+    /* Repeats in transactions, maintained with atomics under the shared lock */
+    pg_atomic_uint64 xacts;     /* transactions running this statement */
+    pg_atomic_uint64 xact_calls; /* its top-level executions in them */
+    pg_atomic_uint64 max_xact_calls; /* most executions in one transaction */
+    pg_atomic_uint64 xact_statements; /* size of those transactions, summed */
+    uint64 send_calls;          /* executions with client send timing */
+    double send_exec_time;      /* total time of those executions */
+    double send_time;           /* time spent in the client DestReceiver */
+    uint64 rows_sent;
+    uint64 bytes_sent;
 } QueryStatEntry;
 
 /* Shared State */
 typedef struct pgqsSharedState {
     LWLock *lock;
     int num_entries;
+    uint64 generation;          /* bumped by reset, invalidates entry indexes */
     QueryStatEntry entries[FLEXIBLE_ARRAY_MEMBER];
 } pgqsSharedState;
 
 static pgqsSharedState *shared_state = NULL;
 
+/*
+ * Backend-local cache of where statements are in shared_state->entries.
+ * Entries stay in place until a reset bumps the generation, so a cached
+ * index only needs checking, and a statement without an entry only needs
+ * the entries added since it was last looked up.
+ */
+typedef struct pgqsEntryIndex {
+    uint64 queryid;             /* hash key */
+    uint64 generation;
+    int index;                  /* -1 if not found */
+    int scanned;                /* entries checked when not found */
+} pgqsEntryIndex;
+
+static HTAB *entry_index_cache = NULL;
+
+/* One distinct statement text in the text store */
+typedef struct pgqsText {
+    uint64 fingerprint;
+    uint32 offset;              /* into the store's data */
+    uint16 full_len;            /* length of the text given to the store */
+    uint16 raw_len;             /* below full_len when truncated */
+    uint16 stored_len;          /* below raw_len when pglz-compressed */
+    uint32 refs;                /* statement and failure entries sharing it */
+} pgqsText;
+
+/*
+ * Statement texts of the statement and failure entries, stored once per
+ * distinct text and pglz-compressed when that saves space.  The data area
+ * after the texts array is append-only until pg_query_stats_reset(), which
+ * empties it together with the entries referring to it.  Texts are only
+ * decompressed for output.
+ *
+ * Every text not yet stored has MAX_QUERY_LENGTH bytes of the data area
+ * kept for it, so a text too long for what is left over is stored cut to
+ * fit in those instead of being dropped.
+ */
+typedef struct pgqsTextStore {
+    LWLock *lock;
+    int max_texts;
+    int num_texts;
+    uint32 data_size;
+    uint32 data_used;
+    uint64 truncated;           /* texts stored cut short */
+    pgqsText texts[FLEXIBLE_ARRAY_MEMBER];
+} pgqsTextStore;
+
+static pgqsTextStore *text_store = NULL;
+
+/* Plan node profile entry, keyed by (dbid, relid, node_type) */
+typedef struct PlanNodeStatEntry {
+    Oid dbid;
+    Oid relid;                  /* scanned relation, or InvalidOid */
+    NodeTag node_type;
+    uint64 calls;               /* node occurrences in sampled executions */
+    uint64 loops;
+    double total_time;          /* exclusive time, children subtracted */
+    double rows;
+    double sum_qerror;          /* row estimate q-error, summed per call */
+    double max_qerror;
+} PlanNodeStatEntry;
+
+typedef struct pgqsPlanNodeState {
+    LWLock *lock;
+    int num_entries;
+    PlanNodeStatEntry entries[MAX_PLAN_NODE_ENTRIES];
+} pgqsPlanNodeState;
+
+static pgqsPlanNodeState *plan_node_state = NULL;
+
+/* Filtered Seq Scan entry, keyed by (dbid, relid, filter columns) */
+typedef struct SeqScanStatEntry {
+    Oid dbid;
+    Oid relid;
+    int nattnums;
+    AttrNumber attnums[MAX_FILTER_COLUMNS]; /* filter columns, ascending */
+    uint64 calls;
+    double rows_returned;
+    double rows_removed;        /* rows removed by filter */
+    double total_time;
+} SeqScanStatEntry;
+
+typedef struct pgqsSeqScanState {
+    LWLock *lock;
+    int num_entries;
+    SeqScanStatEntry entries[MAX_SEQ_SCAN_ENTRIES];
+} pgqsSeqScanState;
+
+static pgqsSeqScanState *seq_scan_state = NULL;
+
+/* Totals of a session's top-level statements */
+typedef struct pgqsSessionStats {
+    int pid;
+    TimestampTz session_start;
+    char application_name[NAMEDATALEN];
+    char client_addr[CLIENT_ADDR_LENGTH];
+    uint64 statements;
+    double total_time;
+    uint64 rows;
+    int64 shared_blks_hit;
+    int64 shared_blks_read;
+    int64 shared_blks_written;
+} pgqsSessionStats;
+
+/*
+ * Per-backend slot, indexed by PGPROC number.  Only the owning backend
+ * writes it; queryid is the statement it is currently executing, 0 if none.
+ * The wait sampler reads queryid alone; readers wanting a consistent copy
+ * of the whole slot retry until changecount is even and unchanged, as with
+ * PgBackendStatus.
+ */
+typedef struct pgqsBackendSlot {
+    pg_atomic_uint64 queryid;
+    uint32 changecount;
+    Oid dbid;
+    int nesting_level;
+    TimestampTz start_time;     /* start of the innermost statement */
+    pgqsSessionStats session;   /* valid while session.pid != 0 */
+} pgqsBackendSlot;
+
+/* Plain copy of a backend slot */
+typedef struct pgqsSlotCopy {
+    uint64 queryid;
+    Oid dbid;
+    int nesting_level;
+    TimestampTz start_time;
+    pgqsSessionStats session;
+} pgqsSlotCopy;
+
+static pgqsBackendSlot *backend_slots = NULL;
+static int num_backend_slots = 0;
+
+#define PGQS_PROCNO(proc) ((int) ((proc) - ProcGlobal->allProcs))
+
+/* Wait profile entry, keyed by (queryid, wait_event_info) */
+typedef struct WaitStatEntry {
+    uint64 queryid;
+    uint32 wait_event_info;     /* 0 when not waiting */
+    uint64 samples;
+    double time;                /* samples weighted by the sample interval */
+} WaitStatEntry;
+
+typedef struct pgqsWaitState {
+    LWLock *lock;
+    int num_entries;
+    WaitStatEntry entries[MAX_WAIT_ENTRIES];
+} pgqsWaitState;
+
+static pgqsWaitState *wait_state = NULL;
+
+/*
+ * Transaction shape entry, keyed by (dbid, fingerprint).  The fingerprint
+ * combines the fingerprints of the transaction's top-level statements in
+ * execution order.
+ */
+typedef struct XactStatEntry {
+    Oid dbid;
+    uint64 fingerprint;
+    int nstatements;            /* statements per transaction */
+    uint64 statements[XACT_SHAPE_STATEMENTS];
+    uint64 calls;
+    uint64 commits;
+    uint64 aborts;
+    double total_time;
+    double min_time;
+    double max_time;
+    double commit_time;         /* from pre-commit to commit */
+    uint64 serialization_failures;  /* aborts with 40001 */
+    uint64 deadlocks;           /* aborts with 40P01 */
+    uint64 retries;             /* transactions that retried a failed one */
+    double retry_wasted_time;   /* failed attempts before a retry loop ended */
+} XactStatEntry;
+
+typedef struct pgqsXactState {
+    LWLock *lock;
+    int num_entries;
+    XactStatEntry entries[MAX_XACT_ENTRIES];
+} pgqsXactState;
+
+static pgqsXactState *xact_state = NULL;
+
+/*
+ * Client think-time inside transactions, keyed by (dbid, transaction
+ * fingerprint, application_name).  Gaps run from the end of one top-level
+ * statement to the start of the next; idle time from the end of the last
+ * statement to commit or abort.
+ */
+typedef struct XactGapStatEntry {
+    Oid dbid;
+    uint64 fingerprint;
+    char application_name[NAMEDATALEN];
+    uint64 xacts;
+    double xact_time;           /* total transaction time */
+    uint64 gaps;
+    double gap_time;
+    double max_gap;
+    double idle_time;           /* last statement to transaction end */
+} XactGapStatEntry;
+
+typedef struct pgqsXactGapState {
+    LWLock *lock;
+    int num_entries;
+    XactGapStatEntry entries[MAX_XACT_GAP_ENTRIES];
+} pgqsXactGapState;
+
+static pgqsXactGapState *xact_gap_state = NULL;
+
+/*
+ * Ended sessions, rolled up per (application_name, client address) when
+ * the backend exits.  Running sessions live in their backend slots.
+ */
+typedef struct ApplicationStatEntry {
+    char application_name[NAMEDATALEN];
+    char client_addr[CLIENT_ADDR_LENGTH];
+    uint64 sessions;
+    double session_time;        /* connected time */
+    uint64 statements;
+    double total_time;
+    uint64 rows;
+    int64 shared_blks_hit;
+    int64 shared_blks_read;
+    int64 shared_blks_written;
+} ApplicationStatEntry;
+
+typedef struct pgqsApplicationState {
+    LWLock *lock;
+    int num_entries;
+    ApplicationStatEntry entries[MAX_APPLICATION_ENTRIES];
+} pgqsApplicationState;
+
+static pgqsApplicationState *application_state = NULL;
+
+/*
+ * Executions that ended in an error, keyed by (queryid, sqlerrcode).  They
+ * never reach ExecutorFinish, so their time is not in the main entries.
+ */
+typedef struct FailureStatEntry {
+    uint64 queryid;
+    int sqlerrcode;             /* 0 if the error was not reported */
+    int text_id;                /* in the text store, -1 if not stored */
+    uint64 failures;
+    double total_time;          /* elapsed before the failure */
+    double max_time;
+} FailureStatEntry;
+
+typedef struct pgqsFailureState {
+    LWLock *lock;
+    int num_entries;
+    FailureStatEntry entries[MAX_FAILURE_ENTRIES];
+} pgqsFailureState;
+
+static pgqsFailureState *failure_state = NULL;
+
+/*
+ * Executor time and buffers per relation, keyed by (dbid, relid).  Each
+ * execution's totals are split evenly between the distinct relations in
+ * its range table.
+ */
+typedef struct RelationStatEntry {
+    Oid dbid;
+    Oid relid;
+    uint64 calls;               /* executions referencing the relation */
+    double total_time;
+    double shared_blks_hit;
+    double shared_blks_read;
+    double shared_blks_dirtied;
+    double shared_blks_written;
+} RelationStatEntry;
+
+typedef struct pgqsRelationState {
+    LWLock *lock;
+    int num_entries;
+    RelationStatEntry entries[MAX_RELATION_ENTRIES];
+} pgqsRelationState;
+
+static pgqsRelationState *relation_state = NULL;
+
+/*
+ * Statements whose plans use an index, keyed by (dbid, indexid, queryid),
+ * with the calls and time of those executions.
+ */
+typedef struct IndexStatEntry {
+    Oid dbid;
+    Oid indexid;
+    uint64 queryid;
+    uint64 calls;
+    double total_time;
+} IndexStatEntry;
+
+typedef struct pgqsIndexState {
+    LWLock *lock;
+    int num_entries;
+    IndexStatEntry entries[MAX_INDEX_ENTRIES];
+} pgqsIndexState;
+
+static pgqsIndexState *index_state = NULL;
+
+/* Lock-free calls and time (microseconds) of one workload class */
+typedef struct pgqsCounter {
+    pg_atomic_uint64 calls;
+    pg_atomic_uint64 time_us;
+} pgqsCounter;
+
+/*
+ * Workload mix of top-level statements by command type, utility command tag
+ * and database.  Fixed-size and never evicted, so it stays complete when
+ * the statement table is full.  Database slots are claimed by CAS on dbids;
+ * databases beyond MAX_DATABASE_COUNTERS share other_databases.
+ */
+typedef struct pgqsWorkloadState {
+    pgqsCounter cmdtypes[PGQS_NUM_CMDTYPES];
+    pgqsCounter cmdtags[COMMAND_TAG_NEXTTAG];
+    pg_atomic_uint32 dbids[MAX_DATABASE_COUNTERS];
+    pgqsCounter databases[MAX_DATABASE_COUNTERS];
+    pgqsCounter other_databases;
+} pgqsWorkloadState;
+
+static pgqsWorkloadState *workload_state = NULL;
+
+/* One captured top-level statement */
+typedef struct pgqsCaptureRecord {
+    TimestampTz start_time;
+    int32 pid;
+    TimestampTz session_start;  /* with pid, identifies the session */
+    Oid dbid;
+    uint64 queryid;
+    double duration;
+    uint16 text_len;
+    uint16 nparams;
+    uint16 params_len;
+    bool truncated;             /* text or parameters did not fit; not replayable */
+    char text[MAX_QUERY_TEXT_LENGTH];
+    char params[CAPTURE_PARAMS_LENGTH]; /* per parameter: isnull, type, length, text */
+} pgqsCaptureRecord;
+
+typedef struct pgqsCaptureCell {
+    pg_atomic_uint64 sequence;
+    pgqsCaptureRecord record;
+} pgqsCaptureCell;
+
+/*
+ * Bounded lock-free queue from backends to the capture writer (Vyukov's
+ * MPMC queue, used with a single consumer).  A cell is free for the
+ * producer claiming position pos when its sequence equals pos, and holds a
+ * record for the consumer when it equals pos + 1.  When the queue is full,
+ * records are dropped and counted rather than making backends wait.
+ */
+typedef struct pgqsCaptureQueue {
+    pg_atomic_uint64 enqueue_pos;
+    uint64 dequeue_pos;         /* writer only */
+    pg_atomic_uint64 captured;
+    pg_atomic_uint64 dropped;
+    Latch *writer_latch;
+    pgqsCaptureCell cells[CAPTURE_QUEUE_SIZE];
+} pgqsCaptureQueue;
+
+static pgqsCaptureQueue *capture_queue = NULL;
+
+/* Nesting depth of ProcessUtility in this backend */
+static int utility_depth = 0;
+
+/* Plan source of the prepared statement an EXECUTE is running, or NULL */
+static CachedPlanSource *execute_plansource = NULL;
+
+/* Nesting depth of ExecutorRun and ExecutorFinish in this backend */
+static int exec_nested_level = 0;
+
+/* SQLSTATE of the last error reported by this backend, 0 once consumed */
+static int last_errcode = 0;
+
+/* Whether this backend's slot holds its session totals */
+static bool session_started = false;
+
+/* Backend-local shape of the current transaction */
+typedef struct {
+    uint64 fingerprint;
+    int nstatements;
+    uint64 statements[XACT_SHAPE_STATEMENTS];
+    TimestampTz pre_commit_time;
+    int ndistinct;              /* repeats of each distinct statement */
+    uint64 distinct_queryids[XACT_DISTINCT_STATEMENTS];
+    uint64 distinct_calls[XACT_DISTINCT_STATEMENTS];
+    TimestampTz last_end_time;  /* end of the last top-level statement */
+    uint64 ngaps;
+    double gap_time;
+    double max_gap;
+} pgqsCurrentXact;
+
+static pgqsCurrentXact current_xact;
+
+/*
+ * Last transaction of this session that failed with a serialization
+ * failure or deadlock.  A transaction starting with the same statement
+ * within pg_query_stats.retry_window is taken as its retry.
+ */
+typedef struct {
+    uint64 first_queryid;
+    TimestampTz failed_at;      /* 0 if no retry is pending */
+    double wasted_time;         /* failed attempts so far */
+} pgqsPendingRetry;
+
+static pgqsPendingRetry pending_retry;
+
+#define PGQS_RETRYABLE(errcode) \
+    ((errcode) == ERRCODE_T_R_SERIALIZATION_FAILURE || \
+     (errcode) == ERRCODE_T_R_DEADLOCK_DETECTED)
+
 /* Executor hooks */
 static ExecutorStart_hook_type prev_ExecutorStart = NULL;
+static ExecutorRun_hook_type prev_ExecutorRun = NULL;
 static ExecutorFinish_hook_type prev_ExecutorFinish = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
+static emit_log_hook_type prev_emit_log_hook = NULL;
+static ProcessUtility_hook_type prev_ProcessUtility = NULL;
+
+/* Where the plan of an execution came from */
+typedef enum pgqsPlanKind {
+    PGQS_PLAN_UNCACHED = 0,
+    PGQS_PLAN_CUSTOM,
+    PGQS_PLAN_GENERIC
+} pgqsPlanKind;
 
 /* Backend-local query timing list */
 typedef struct {
     QueryDesc *query;
+    uint64 queryid;
+    int xact_level;             /* transaction nest level at start */
+    bool toplevel;              /* sent by the client, not run by SPI or a utility */
     TimestampTz start_time;
+    bool sampled;               /* plan instrumentation requested */
+    BufferUsage bufusage_start;
+    pgqsPlanKind plan_kind;
+    int entry_index;            /* counted in this QueryStatEntry's inflight */
+    uint64 entry_generation;
+    int concurrency_bucket;     /* -1 if not counted */
+    bool send_timed;            /* ran at least once with a timing receiver */
+    double send_time;
+    uint64 rows_sent;
+    uint64 bytes_sent;
+    char query_text[MAX_QUERY_TEXT_LENGTH]; /* sourceText may be freed by an abort */
 } pgqsQueryEntry;
 
+/* DestReceiver wrapper timing the client receiver it forwards to */
+typedef struct {
+    DestReceiver pub;
+    DestReceiver *inner;
+    instr_time send_time;
+    uint64 rows;
+    uint64 bytes;
+} pgqsTimingDest;
+
+/* Measurements of one execution, folded into its QueryStatEntry */
+typedef struct {
+    double duration;
+    bool sampled;
+    double max_qerror;          /* worst node q-error, sampled only */
+    BufferUsage bufusage;
+    bool spilled;
+    int64 peak_mem_kb;          /* sampled only */
+    int64 suggested_work_mem_kb; /* sampled only */
+    int workers_planned;
+    int workers_launched;
+    double leader_time;         /* sampled only */
+    double worker_time;         /* sampled only */
+    double gather_time;         /* sampled only */
+    JitInstrumentation jit;     /* leader and workers combined */
+    pgqsPlanKind plan_kind;
+    int concurrency_bucket;     /* -1 if unknown */
+    bool send_timed;
+    double send_time;
+    uint64 rows_sent;
+    uint64 bytes_sent;
+} pgqsExecStats;
+
+/* Per-node measurements gathered from one sampled execution */
+typedef struct {
+    NodeTag node_type;
+    Oid relid;
+    uint64 loops;
+    double time;
+    double rows;
+    double qerror;
+    int64 mem_kb;               /* sort/hash memory, largest process */
+    int64 needed_kb;            /* work_mem that would have avoided a spill */
+    double rows_removed;        /* rows removed by filter */
+    int nfilter_cols;           /* -1 unless a Seq Scan with a filter */
+    AttrNumber filter_cols[MAX_FILTER_COLUMNS];
+} pgqsNodeSample;
+
 static List *query_times_list = NIL;
 
 /* Function prototypes */
 static void pgqs_shmem_startup(void);
 static void pgqs_shmem_request(void);
 static char *pgqs_normalize_query(const char *query);
-static void pgqs_update_stats(const char *query, double duration);
+static uint64 pgqs_fingerprint(const char *query);
+static void pgqs_update_stats(pgqsQueryEntry *qentry, const char *query, const pgqsExecStats *stats);
+static int pgqs_store_text(uint64 fingerprint, const char *text, int len);
+static char *pgqs_fetch_text(int text_id);
+static void pgqs_collect_plan_nodes(QueryDesc *queryDesc, pgqsExecStats *stats);
+static const char *pgqs_node_type_name(NodeTag node_type);
 static void pgqs_ExecutorStart(QueryDesc *queryDesc, int eflags);
+static void pgqs_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+                             uint64 count, bool execute_once);
 static void pgqs_ExecutorFinish(QueryDesc *queryDesc);
+static void pgqs_ExecutorEnd(QueryDesc *queryDesc);
+static const char *pgqs_statement_text(const char *source, PlannedStmt *pstmt, int *len);
+static void pgqs_capture_statement(TimestampTz start_time, double duration, uint64 queryid,
+                                   const char *text, int text_len, ParamListInfo params);
+static void pgqs_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+                                bool readOnlyTree, ProcessUtilityContext context,
+                                ParamListInfo params, QueryEnvironment *queryEnv,
+                                DestReceiver *dest, QueryCompletion *qc);
+static void pgqs_xact_callback(XactEvent event, void *arg);
+static void pgqs_emit_log(ErrorData *edata);
+static void pgqs_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                                  SubTransactionId parentSubid, void *arg);
+
+/* Background worker entry points */
+PGDLLEXPORT void pgqs_wait_sampler_main(Datum main_arg);
+PGDLLEXPORT void pgqs_exporter_main(Datum main_arg);
+PGDLLEXPORT void pgqs_capture_writer_main(Datum main_arg);
 
 /* SQL-callable functions */
 PG_FUNCTION_INFO_V1(pg_query_stats);
 PG_FUNCTION_INFO_V1(pg_query_stats_reset);
+PG_FUNCTION_INFO_V1(pg_query_stats_plan_nodes);
+PG_FUNCTION_INFO_V1(pg_query_stats_estimates);
+PG_FUNCTION_INFO_V1(pg_query_stats_spills);
+PG_FUNCTION_INFO_V1(pg_query_stats_seq_scans);
+PG_FUNCTION_INFO_V1(pg_query_stats_parallel);
+PG_FUNCTION_INFO_V1(pg_query_stats_jit);
+PG_FUNCTION_INFO_V1(pg_query_stats_plan_cache);
+PG_FUNCTION_INFO_V1(pg_query_stats_waits);
+PG_FUNCTION_INFO_V1(pg_query_stats_active);
+PG_FUNCTION_INFO_V1(pg_query_stats_concurrency);
+PG_FUNCTION_INFO_V1(pg_query_stats_client_send);
+PG_FUNCTION_INFO_V1(pg_query_stats_xacts);
+PG_FUNCTION_INFO_V1(pg_query_stats_repeats);
+PG_FUNCTION_INFO_V1(pg_query_stats_xact_gaps);
+PG_FUNCTION_INFO_V1(pg_query_stats_sessions);
+PG_FUNCTION_INFO_V1(pg_query_stats_applications);
+PG_FUNCTION_INFO_V1(pg_query_stats_failures);
+PG_FUNCTION_INFO_V1(pg_query_stats_relations);
+PG_FUNCTION_INFO_V1(pg_query_stats_indexes);
+PG_FUNCTION_INFO_V1(pg_query_stats_workload);
+PG_FUNCTION_INFO_V1(pg_query_stats_export);
+PG_FUNCTION_INFO_V1(pg_query_stats_merge);
+PG_FUNCTION_INFO_V1(pg_query_stats_json);
+PG_FUNCTION_INFO_V1(pg_query_stats_arrow);
+PG_FUNCTION_INFO_V1(pg_query_stats_capture_info);
+PG_FUNCTION_INFO_V1(pg_query_stats_info);
 
 /* Shared memory initialization */
 void _PG_init(void) {
@@ -104,24 +788,275 @@ void _PG_init(void) {
                              0,
                              NULL, NULL, NULL);
 
+    DefineCustomRealVariable("pg_query_stats.plan_sample_rate",
+                             "Fraction of executions instrumented for plan node statistics",
+                             "Sampled executions run with per-node timing, like EXPLAIN ANALYZE. 0 disables.",
+                             &pgqs_plan_sample_rate,
+                             0.0,
+                             0.0,
+                             1.0,
+                             PGC_SUSET,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("pg_query_stats.wait_sampling",
+                             "Start a background worker sampling wait events of running statements",
+                             NULL,
+                             &pgqs_wait_sampling,
+                             false,
+                             PGC_POSTMASTER,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_query_stats.wait_sample_interval",
+                            "Interval between wait event samples (ms)",
+                            NULL,
+                            &pgqs_wait_sample_interval,
+                            10,
+                            1,
+                            1000,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MS,
+                            NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("pg_query_stats.track_client_send",
+                             "Time rows sent to the client separately from execution",
+                             "Adds a clock reading around every row sent to the client.",
+                             &pgqs_track_client_send,
+                             false,
+                             PGC_SUSET,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_query_stats.retry_window",
+                            "Longest pause after a serialization failure or deadlock for the next transaction to count as its retry (ms)",
+                            NULL,
+                            &pgqs_retry_window,
+                            1000,
+                            0,
+                            INT_MAX,
+                            PGC_SUSET,
+                            GUC_UNIT_MS,
+                            NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("pg_query_stats.track_relations",
+                             "Apportion execution time and buffers to the relations each statement references",
+                             NULL,
+                             &pgqs_track_relations,
+                             false,
+                             PGC_SUSET,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("pg_query_stats.track_indexes",
+                             "Record which indexes each statement's plan uses",
+                             NULL,
+                             &pgqs_track_indexes,
+                             false,
+                             PGC_SUSET,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomStringVariable("pg_query_stats.exporter_listen",
+                               "Address the OpenMetrics exporter listens on",
+                               "host:port for TCP, or an absolute path for a Unix socket. Empty disables the exporter.",
+                               &pgqs_exporter_listen,
+                               "",
+                               PGC_POSTMASTER,
+                               0,
+                               NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_query_stats.exporter_top_n",
+                            "Number of statements, by total time, exported as metrics",
+                            NULL,
+                            &pgqs_exporter_top_n,
+                            50,
+                            0,
+                            10000,
+                            PGC_SIGHUP,
+                            0,
+                            NULL, NULL, NULL);
+
+    if (pgqs_exporter_listen && pgqs_exporter_listen[0] != '\0') {
+        BackgroundWorker worker;
+
+        memset(&worker, 0, sizeof(worker));
+        worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+        worker.bgw_start_time = BgWorkerStart_ConsistentState;
+        worker.bgw_restart_time = 10;
+        snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_query_stats");
+        snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgqs_exporter_main");
+        snprintf(worker.bgw_name, BGW_MAXLEN, "pg_query_stats exporter");
+        snprintf(worker.bgw_type, BGW_MAXLEN, "pg_query_stats exporter");
+        RegisterBackgroundWorker(&worker);
+    }
+
+    DefineCustomStringVariable("pg_query_stats.capture_directory",
+                               "Directory workload capture files are written to",
+                               "Relative paths are under the data directory. Empty disables capture.",
+                               &pgqs_capture_directory,
+                               "",
+                               PGC_POSTMASTER,
+                               0,
+                               NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("pg_query_stats.capture",
+                             "Capture top-level statements for replay",
+                             "Requires pg_query_stats.capture_directory.",
+                             &pgqs_capture,
+                             false,
+                             PGC_SUSET,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_query_stats.capture_file_size",
+                            "Size at which a workload capture file is rotated",
+                            NULL,
+                            &pgqs_capture_file_size,
+                            64,
+                            1,
+                            MAX_KILOBYTES / 1024,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MB,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_query_stats.capture_max_files",
+                            "Number of workload capture files kept",
+                            "The oldest files are deleted when a new one is started. 0 keeps all files.",
+                            &pgqs_capture_max_files,
+                            16,
+                            0,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            0,
+                            NULL, NULL, NULL);
+
+    if (pgqs_capture_directory && pgqs_capture_directory[0] != '\0') {
+        BackgroundWorker worker;
+
+        memset(&worker, 0, sizeof(worker));
+        worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+        worker.bgw_start_time = BgWorkerStart_ConsistentState;
+        worker.bgw_restart_time = 10;
+        snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_query_stats");
+        snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgqs_capture_writer_main");
+        snprintf(worker.bgw_name, BGW_MAXLEN, "pg_query_stats capture writer");
+        snprintf(worker.bgw_type, BGW_MAXLEN, "pg_query_stats capture writer");
+        RegisterBackgroundWorker(&worker);
+    }
+
+    if (pgqs_wait_sampling) {
+        BackgroundWorker worker;
+
+        memset(&worker, 0, sizeof(worker));
+        worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+        worker.bgw_start_time = BgWorkerStart_ConsistentState;
+        worker.bgw_restart_time = 10;
+        snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_query_stats");
+        snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgqs_wait_sampler_main");
+        snprintf(worker.bgw_name, BGW_MAXLEN, "pg_query_stats wait sampler");
+        snprintf(worker.bgw_type, BGW_MAXLEN, "pg_query_stats wait sampler");
+        RegisterBackgroundWorker(&worker);
+    }
+
     shmem_request_hook = pgqs_shmem_request;
     shmem_startup_hook = pgqs_shmem_startup;
 
     prev_ExecutorStart = ExecutorStart_hook;
     ExecutorStart_hook = pgqs_ExecutorStart;
 
+    prev_ExecutorRun = ExecutorRun_hook;
+    ExecutorRun_hook = pgqs_ExecutorRun;
+
     prev_ExecutorFinish = ExecutorFinish_hook;
     ExecutorFinish_hook = pgqs_ExecutorFinish;
 
+    prev_ExecutorEnd = ExecutorEnd_hook;
+    ExecutorEnd_hook = pgqs_ExecutorEnd;
+
+    prev_ProcessUtility = ProcessUtility_hook;
+    ProcessUtility_hook = pgqs_ProcessUtility;
+
+    prev_emit_log_hook = emit_log_hook;
+    emit_log_hook = pgqs_emit_log;
+
+    RegisterXactCallback(pgqs_xact_callback, NULL);
+    RegisterSubXactCallback(pgqs_subxact_callback, NULL);
+
     elog(LOG, "pg_query_stats: Hooks registered - Start=%p, Finish=%p", 
          pgqs_ExecutorStart, pgqs_ExecutorFinish);
 }
 
+/* Text store: a text per statement or failure entry at most */
+static Size pgqs_text_store_size(void) {
+    int max_texts = pgqs_max_entries + MAX_FAILURE_ENTRIES;
+
+    return add_size(offsetof(pgqsTextStore, texts),
+                    mul_size(max_texts, sizeof(pgqsText) + MAX_QUERY_LENGTH));
+}
+
 /* Shared memory request */
 static void pgqs_shmem_request(void) {
     RequestAddinShmemSpace(offsetof(pgqsSharedState, entries) +
                            (pgqs_max_entries * sizeof(QueryStatEntry)));
-    RequestNamedLWLockTranche("pg_query_stats", 1);
+    RequestAddinShmemSpace(pgqs_text_store_size());
+    RequestAddinShmemSpace(sizeof(pgqsPlanNodeState));
+    RequestAddinShmemSpace(sizeof(pgqsSeqScanState));
+    RequestAddinShmemSpace(mul_size(MaxBackends, sizeof(pgqsBackendSlot)));
+    RequestAddinShmemSpace(sizeof(pgqsWaitState));
+    RequestAddinShmemSpace(sizeof(pgqsXactState));
+    RequestAddinShmemSpace(sizeof(pgqsXactGapState));
+    RequestAddinShmemSpace(sizeof(pgqsApplicationState));
+    RequestAddinShmemSpace(sizeof(pgqsFailureState));
+    RequestAddinShmemSpace(sizeof(pgqsRelationState));
+    RequestAddinShmemSpace(sizeof(pgqsIndexState));
+    RequestAddinShmemSpace(sizeof(pgqsWorkloadState));
+    if (pgqs_capture_directory && pgqs_capture_directory[0] != '\0')
+        RequestAddinShmemSpace(sizeof(pgqsCaptureQueue));
+    RequestNamedLWLockTranche("pg_query_stats", PGQS_NUM_LOCKS);
+}
+
+/* Workload counters */
+static void pgqs_init_counter(pgqsCounter *counter)
+{
+    pg_atomic_init_u64(&counter->calls, 0);
+    pg_atomic_init_u64(&counter->time_us, 0);
+}
+
+static void pgqs_reset_counter(pgqsCounter *counter)
+{
+    pg_atomic_write_u64(&counter->calls, 0);
+    pg_atomic_write_u64(&counter->time_us, 0);
+}
+
+static void pgqs_count(pgqsCounter *counter, double duration_ms)
+{
+    pg_atomic_fetch_add_u64(&counter->calls, 1);
+    pg_atomic_fetch_add_u64(&counter->time_us, (uint64) (duration_ms * 1000.0));
+}
+
+/* This database's counter, claiming a free slot on first use */
+static pgqsCounter *pgqs_database_counter(void)
+{
+    int i;
+
+    for (i = 0; i < MAX_DATABASE_COUNTERS; i++) {
+        uint32 dbid = pg_atomic_read_u32(&workload_state->dbids[i]);
+
+        if (dbid == MyDatabaseId)
+            return &workload_state->databases[i];
+
+        if (dbid == InvalidOid) {
+            uint32 expected = InvalidOid;
+
+            if (pg_atomic_compare_exchange_u32(&workload_state->dbids[i],
+                                               &expected, MyDatabaseId) ||
+                expected == MyDatabaseId)
+                return &workload_state->databases[i];
+        }
+    }
+
+    return &workload_state->other_databases;
 }
 
 /* Shared memory startup */
@@ -138,14 +1073,149 @@ static void pgqs_shmem_startup(void) {
     if (!shared_state)
         elog(ERROR, "pg_query_stats: could not allocate shared memory");
 
-    shared_state->lock = &(GetNamedLWLockTranche("pg_query_stats"))->lock;
+    shared_state->lock = &(GetNamedLWLockTranche("pg_query_stats"))[PGQS_LOCK_ENTRIES].lock;
 
     if (!found) {
         shared_state->num_entries = 0;
+        shared_state->generation = 0;
         memset(shared_state->entries, 0, pgqs_max_entries * sizeof(QueryStatEntry));
         elog(LOG, "pg_query_stats: initialized shared memory");
     }
 
+    plan_node_state = ShmemInitStruct("pg_query_stats_plan_nodes",
+                                      sizeof(pgqsPlanNodeState),
+                                      &found);
+    plan_node_state->lock = &(GetNamedLWLockTranche("pg_query_stats"))[PGQS_LOCK_PLAN_NODES].lock;
+
+    if (!found)
+        plan_node_state->num_entries = 0;
+
+    seq_scan_state = ShmemInitStruct("pg_query_stats_seq_scans",
+                                     sizeof(pgqsSeqScanState),
+                                     &found);
+    seq_scan_state->lock = &(GetNamedLWLockTranche("pg_query_stats"))[PGQS_LOCK_SEQ_SCANS].lock;
+
+    if (!found)
+        seq_scan_state->num_entries = 0;
+
+    num_backend_slots = MaxBackends;
+    backend_slots = ShmemInitStruct("pg_query_stats_backends",
+                                    mul_size(num_backend_slots, sizeof(pgqsBackendSlot)),
+                                    &found);
+
+    if (!found) {
+        int i;
+
+        memset(backend_slots, 0, mul_size(num_backend_slots, sizeof(pgqsBackendSlot)));
+        for (i = 0; i < num_backend_slots; i++)
+            pg_atomic_init_u64(&backend_slots[i].queryid, 0);
+    }
+
+    wait_state = ShmemInitStruct("pg_query_stats_waits",
+                                 sizeof(pgqsWaitState),
+                                 &found);
+    wait_state->lock = &(GetNamedLWLockTranche("pg_query_stats"))[PGQS_LOCK_WAITS].lock;
+
+    if (!found)
+        wait_state->num_entries = 0;
+
+    xact_state = ShmemInitStruct("pg_query_stats_xacts",
+                                 sizeof(pgqsXactState),
+                                 &found);
+    xact_state->lock = &(GetNamedLWLockTranche("pg_query_stats"))[PGQS_LOCK_XACTS].lock;
+
+    if (!found)
+        xact_state->num_entries = 0;
+
+    xact_gap_state = ShmemInitStruct("pg_query_stats_xact_gaps",
+                                     sizeof(pgqsXactGapState),
+                                     &found);
+    xact_gap_state->lock = &(GetNamedLWLockTranche("pg_query_stats"))[PGQS_LOCK_XACT_GAPS].lock;
+
+    if (!found)
+        xact_gap_state->num_entries = 0;
+
+    application_state = ShmemInitStruct("pg_query_stats_applications",
+                                        sizeof(pgqsApplicationState),
+                                        &found);
+    application_state->lock = &(GetNamedLWLockTranche("pg_query_stats"))[PGQS_LOCK_APPLICATIONS].lock;
+
+    if (!found)
+        application_state->num_entries = 0;
+
+    failure_state = ShmemInitStruct("pg_query_stats_failures",
+                                    sizeof(pgqsFailureState),
+                                    &found);
+    failure_state->lock = &(GetNamedLWLockTranche("pg_query_stats"))[PGQS_LOCK_FAILURES].lock;
+
+    if (!found)
+        failure_state->num_entries = 0;
+
+    text_store = ShmemInitStruct("pg_query_stats_texts",
+                                 pgqs_text_store_size(),
+                                 &found);
+    text_store->lock = &(GetNamedLWLockTranche("pg_query_stats"))[PGQS_LOCK_TEXTS].lock;
+
+    if (!found) {
+        text_store->max_texts = pgqs_max_entries + MAX_FAILURE_ENTRIES;
+        text_store->num_texts = 0;
+        text_store->data_size = text_store->max_texts * MAX_QUERY_LENGTH;
+        text_store->data_used = 0;
+        text_store->truncated = 0;
+    }
+
+    relation_state = ShmemInitStruct("pg_query_stats_relations",
+                                     sizeof(pgqsRelationState),
+                                     &found);
+    relation_state->lock = &(GetNamedLWLockTranche("pg_query_stats"))[PGQS_LOCK_RELATIONS].lock;
+
+    if (!found)
+        relation_state->num_entries = 0;
+
+    index_state = ShmemInitStruct("pg_query_stats_indexes",
+                                  sizeof(pgqsIndexState),
+                                  &found);
+    index_state->lock = &(GetNamedLWLockTranche("pg_query_stats"))[PGQS_LOCK_INDEXES].lock;
+
+    if (!found)
+        index_state->num_entries = 0;
+
+    workload_state = ShmemInitStruct("pg_query_stats_workload",
+                                     sizeof(pgqsWorkloadState),
+                                     &found);
+
+    if (!found) {
+        int i;
+
+        for (i = 0; i < PGQS_NUM_CMDTYPES; i++)
+            pgqs_init_counter(&workload_state->cmdtypes[i]);
+        for (i = 0; i < COMMAND_TAG_NEXTTAG; i++)
+            pgqs_init_counter(&workload_state->cmdtags[i]);
+        for (i = 0; i < MAX_DATABASE_COUNTERS; i++) {
+            pg_atomic_init_u32(&workload_state->dbids[i], InvalidOid);
+            pgqs_init_counter(&workload_state->databases[i]);
+        }
+        pgqs_init_counter(&workload_state->other_databases);
+    }
+
+    if (pgqs_capture_directory && pgqs_capture_directory[0] != '\0') {
+        capture_queue = ShmemInitStruct("pg_query_stats_capture",
+                                        sizeof(pgqsCaptureQueue),
+                                        &found);
+
+        if (!found) {
+            int i;
+
+            pg_atomic_init_u64(&capture_queue->enqueue_pos, 0);
+            capture_queue->dequeue_pos = 0;
+            pg_atomic_init_u64(&capture_queue->captured, 0);
+            pg_atomic_init_u64(&capture_queue->dropped, 0);
+            capture_queue->writer_latch = NULL;
+            for (i = 0; i < CAPTURE_QUEUE_SIZE; i++)
+                pg_atomic_init_u64(&capture_queue->cells[i].sequence, i);
+        }
+    }
+
     LWLockRelease(AddinShmemInitLock);
 }
 
@@ -177,176 +1247,4874 @@ static char *pgqs_normalize_query(const char *query) {
     return normalized;
 }
 
-/* Update shared stats */
-static void pgqs_update_stats(const char *query, double duration) {
+static void pgqs_init_entry_atomics(QueryStatEntry *entry) {
     int i;
-    char normalized[MAX_QUERY_LENGTH];
 
-    if (!shared_state) {
-        elog(WARNING, "pg_query_stats: shared_state is NULL");
-        return;
+    pg_atomic_init_u32(&entry->inflight, 0);
+    pg_atomic_init_u32(&entry->peak_concurrency, 0);
+    pg_atomic_init_u64(&entry->concurrency_starts, 0);
+    pg_atomic_init_u64(&entry->concurrency_sum, 0);
+    for (i = 0; i < CONCURRENCY_BUCKETS; i++)
+        pg_atomic_init_u64(&entry->concurrency_hist[i], 0);
+    pg_atomic_init_u64(&entry->xacts, 0);
+    pg_atomic_init_u64(&entry->xact_calls, 0);
+    pg_atomic_init_u64(&entry->max_xact_calls, 0);
+    pg_atomic_init_u64(&entry->xact_statements, 0);
+}
+
+/*
+ * Index of the statement's entry in shared_state->entries, or -1.  Caller
+ * holds shared_state->lock.
+ */
+static int pgqs_lookup_entry(uint64 queryid) {
+    pgqsEntryIndex *cached;
+    int start = 0;
+    int i;
+
+    /* Stale indexes of earlier generations pile up; start over then */
+    if (entry_index_cache && hash_get_num_entries(entry_index_cache) > 2 * pgqs_max_entries) {
+        hash_destroy(entry_index_cache);
+        entry_index_cache = NULL;
     }
 
-    strncpy(normalized, query, MAX_QUERY_LENGTH - 1);
-    normalized[MAX_QUERY_LENGTH - 1] = '\0';
+    if (!entry_index_cache) {
+        HASHCTL ctl;
 
-    LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
+        ctl.keysize = sizeof(uint64);
+        ctl.entrysize = sizeof(pgqsEntryIndex);
+        ctl.hcxt = TopMemoryContext;
+        entry_index_cache = hash_create("pg_query_stats entry indexes", 256, &ctl,
+                                        HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
 
-    for (i = 0; i < shared_state->num_entries; i++) {
-        if (strcmp(shared_state->entries[i].query_text, normalized) == 0) {
-            shared_state->entries[i].calls++;
-            shared_state->entries[i].total_time += duration;
-            if (duration < shared_state->entries[i].min_time)
-                shared_state->entries[i].min_time = duration;
-            if (duration > shared_state->entries[i].max_time)
-                shared_state->entries[i].max_time = duration;
-            LWLockRelease(shared_state->lock);
-            return;
-        }
+    cached = hash_search(entry_index_cache, &queryid, HASH_FIND, NULL);
+    if (cached && cached->generation == shared_state->generation) {
+        if (cached->index >= 0)
+            return cached->index;
+        start = cached->scanned;
     }
 
-    if (shared_state->num_entries < pgqs_max_entries) {
-        QueryStatEntry *entry = &shared_state->entries[shared_state->num_entries];
-        strncpy(entry->query_text, normalized, MAX_QUERY_LENGTH);
-        entry->calls = 1;
-        entry->total_time = duration;
-        entry->min_time = duration;
-        entry->max_time = duration;
-        shared_state->num_entries++;
-        elog(LOG, "pg_query_stats: added new entry for: %s", normalized);
+    for (i = start; i < shared_state->num_entries; i++) {
+        if (shared_state->entries[i].queryid == queryid)
+            break;
     }
 
-    LWLockRelease(shared_state->lock);
+    if (!cached)
+        cached = hash_search(entry_index_cache, &queryid, HASH_ENTER, NULL);
+    cached->generation = shared_state->generation;
+    cached->index = i < shared_state->num_entries ? i : -1;
+    cached->scanned = shared_state->num_entries;
+
+    return cached->index;
 }
 
-/* ExecutorStart: store start time */
-static void pgqs_ExecutorStart(QueryDesc *queryDesc, int eflags)
-{
-    pgqsQueryEntry *entry;
+/*
+ * Count a starting execution in its entry's in-flight counter, if the
+ * statement has an entry yet, and record the concurrency it started into.
+ */
+static void pgqs_enter_entry(pgqsQueryEntry *qentry) {
+    QueryStatEntry *entry;
+    uint32 concurrency;
+    uint32 peak;
+    int bucket;
+    int i;
 
-    if (prev_ExecutorStart)
-        prev_ExecutorStart(queryDesc, eflags);
-    else
-        standard_ExecutorStart(queryDesc, eflags);
+    qentry->entry_index = -1;
+    qentry->concurrency_bucket = -1;
 
-    if (!pgqs_enabled || !queryDesc->sourceText)
+    if (!shared_state)
         return;
 
-    if (strstr(queryDesc->sourceText, "pg_query_stats") != NULL)
+    LWLockAcquire(shared_state->lock, LW_SHARED);
+
+    i = pgqs_lookup_entry(qentry->queryid);
+    if (i < 0) {
+        LWLockRelease(shared_state->lock);
         return;
+    }
 
-    entry = palloc(sizeof(pgqsQueryEntry));
-    entry->query = queryDesc;
-    entry->start_time = GetCurrentTimestamp();
-    query_times_list = lappend(query_times_list, entry);
+    entry = &shared_state->entries[i];
+    concurrency = pg_atomic_add_fetch_u32(&entry->inflight, 1);
+    peak = pg_atomic_read_u32(&entry->peak_concurrency);
+    bucket = Min((int) pg_ceil_log2_32(concurrency), CONCURRENCY_BUCKETS - 1);
+
+    while (concurrency > peak &&
+           !pg_atomic_compare_exchange_u32(&entry->peak_concurrency, &peak, concurrency))
+        ;
+
+    pg_atomic_fetch_add_u64(&entry->concurrency_starts, 1);
+    pg_atomic_fetch_add_u64(&entry->concurrency_sum, concurrency);
+    pg_atomic_fetch_add_u64(&entry->concurrency_hist[bucket], 1);
+
+    qentry->entry_index = i;
+    qentry->entry_generation = shared_state->generation;
+    qentry->concurrency_bucket = bucket;
 
-    elog(LOG, "pg_query_stats: stored start time for query: %s", queryDesc->sourceText);
+    LWLockRelease(shared_state->lock);
 }
 
-/* ExecutorFinish: calculate duration */
-static void pgqs_ExecutorFinish(QueryDesc *queryDesc)
+/* Undo pgqs_enter_entry when the execution finishes or aborts */
+static void pgqs_leave_entry(pgqsQueryEntry *qentry) {
+    if (qentry->entry_index < 0 || !shared_state)
+        return;
+
+    LWLockAcquire(shared_state->lock, LW_SHARED);
+
+    if (shared_state->generation == qentry->entry_generation &&
+        qentry->entry_index < shared_state->num_entries)
+        pg_atomic_fetch_sub_u32(&shared_state->entries[qentry->entry_index].inflight, 1);
+
+    LWLockRelease(shared_state->lock);
+
+    qentry->entry_index = -1;
+}
+
+/* Statement fingerprint: hash of the stored (truncated) query text */
+static uint64 pgqs_fingerprint(const char *query) {
+    return hash_bytes_extended((const unsigned char *) query,
+                               strnlen(query, MAX_QUERY_TEXT_LENGTH - 1), 0);
+}
+
+/* pglz-compress a text into buf if that makes it smaller; the stored length */
+static int pgqs_compress_text(const char *text, int len, char *buf, const char **data)
 {
-    ListCell *lc;
-    pgqsQueryEntry *entry = NULL;
+    int32 compressed_len = pglz_compress(text, len, buf, PGLZ_strategy_default);
 
-    if (prev_ExecutorFinish)
-        prev_ExecutorFinish(queryDesc);
-    else
-        standard_ExecutorFinish(queryDesc);
+    if (compressed_len >= 0 && compressed_len < len) {
+        *data = buf;
+        return compressed_len;
+    }
+
+    *data = text;
+    return len;
+}
+
+/*
+ * Store a statement text, sharing an identical stored one, and return its
+ * id in the text store, or -1 if the store is full.  Texts are compressed
+ * before the store is locked.
+ */
+static int pgqs_store_text(uint64 fingerprint, const char *text, int len) {
+    char *compressed = palloc(PGLZ_MAX_OUTPUT(len));
+    char *short_compressed = NULL;
+    const char *data;
+    const char *short_data = NULL;
+    int stored_len;
+    int short_len = len;
+    int short_stored_len = 0;
+    pgqsText *t;
+    int id = -1;
+    int i;
+
+    stored_len = pgqs_compress_text(text, len, compressed, &data);
+
+    /* What to store if the whole text does not fit */
+    if (stored_len > MAX_QUERY_LENGTH) {
+        short_len = pg_mbcliplen(text, len, MAX_QUERY_LENGTH - 1);
+        short_compressed = palloc(PGLZ_MAX_OUTPUT(short_len));
+        short_stored_len = pgqs_compress_text(text, short_len, short_compressed, &short_data);
+    }
+
+    LWLockAcquire(text_store->lock, LW_EXCLUSIVE);
+
+    for (i = 0; i < text_store->num_texts; i++) {
+        t = &text_store->texts[i];
+        if (t->fingerprint == fingerprint && t->full_len == len) {
+            t->refs++;
+            id = i;
+            break;
+        }
+    }
+
+    if (id < 0 && text_store->num_texts < text_store->max_texts) {
+        char *area = (char *) &text_store->texts[text_store->max_texts];
+        int64 kept = (int64) (text_store->max_texts - text_store->num_texts - 1) * MAX_QUERY_LENGTH;
+
+        id = text_store->num_texts++;
+        t = &text_store->texts[id];
+        t->fingerprint = fingerprint;
+        t->offset = text_store->data_used;
+        t->full_len = len;
+        t->refs = 1;
+
+        if (text_store->data_used + stored_len + kept <= text_store->data_size) {
+            t->raw_len = len;
+            t->stored_len = stored_len;
+            memcpy(area + t->offset, data, stored_len);
+        } else {
+            t->raw_len = short_len;
+            t->stored_len = short_stored_len;
+            memcpy(area + t->offset, short_data, short_stored_len);
+            text_store->truncated++;
+        }
+        text_store->data_used += t->stored_len;
+    }
+
+    LWLockRelease(text_store->lock);
+
+    pfree(compressed);
+    if (short_compressed)
+        pfree(short_compressed);
+    return id;
+}
+
+/*
+ * Drop a reference taken by pgqs_store_text() that ended up unused.  The
+ * space of an unreferenced text is given back when it is the last one.
+ */
+static void pgqs_release_text(int text_id)
+{
+    pgqsText *t;
+
+    LWLockAcquire(text_store->lock, LW_EXCLUSIVE);
+
+    if (text_id >= 0 && text_id < text_store->num_texts) {
+        t = &text_store->texts[text_id];
+        if (--t->refs == 0 && text_id == text_store->num_texts - 1) {
+            text_store->num_texts--;
+            text_store->data_used = t->offset;
+        }
+    }
+
+    LWLockRelease(text_store->lock);
+}
+
+/* A stored statement text, decompressed and palloc'd; empty if not stored */
+static char *pgqs_fetch_text(int text_id) {
+    char *result;
+    pgqsText *t;
+    char *data;
+
+    LWLockAcquire(text_store->lock, LW_SHARED);
+
+    if (text_id < 0 || text_id >= text_store->num_texts) {
+        LWLockRelease(text_store->lock);
+        return pstrdup("");
+    }
+
+    t = &text_store->texts[text_id];
+    data = (char *) &text_store->texts[text_store->max_texts] + t->offset;
+    result = palloc(t->raw_len + 1);
 
-    if (!pgqs_enabled || !queryDesc->sourceText)
+    if (t->stored_len < t->raw_len) {
+        if (pglz_decompress(data, t->stored_len, result, t->raw_len, true) != t->raw_len)
+            elog(ERROR, "pg_query_stats: stored statement text is corrupt");
+    } else {
+        memcpy(result, data, t->raw_len);
+    }
+    result[t->raw_len] = '\0';
+
+    LWLockRelease(text_store->lock);
+
+    return result;
+}
+
+/* Update shared stats */
+static void pgqs_update_stats(pgqsQueryEntry *qentry, const char *query, const pgqsExecStats *stats) {
+    uint64 queryid = qentry->queryid;
+    int i;
+    int query_len = strnlen(query, MAX_QUERY_TEXT_LENGTH - 1);
+    double duration = stats->duration;
+    QueryStatEntry *entry = NULL;
+    int text_id = -1;
+
+    if (!shared_state) {
+        elog(WARNING, "pg_query_stats: shared_state is NULL");
         return;
+    }
 
-    foreach(lc, query_times_list)
+    LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
+
+    /* The entry this execution was counted in at start, if it had one */
+    if (qentry->entry_index >= 0 && qentry->entry_generation == shared_state->generation)
+        i = qentry->entry_index;
+    else
+        i = pgqs_lookup_entry(queryid);
+
+    /*
+     * A new statement's text is compressed and stored without holding the
+     * statement table lock, so the entry is looked up again afterwards: it
+     * may have been added meanwhile, or the table reset with the texts.
+     */
+    while (i < 0 && shared_state->num_entries < pgqs_max_entries) {
+        uint64 generation = shared_state->generation;
+
+        LWLockRelease(shared_state->lock);
+        text_id = pgqs_store_text(queryid, query, query_len);
+        LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
+
+        if (shared_state->generation != generation) {
+            text_id = -1;
+            i = pgqs_lookup_entry(queryid);
+            continue;
+        }
+
+        i = pgqs_lookup_entry(queryid);
+        if (i >= 0 || shared_state->num_entries >= pgqs_max_entries) {
+            pgqs_release_text(text_id);
+            text_id = -1;
+        }
+        break;
+    }
+
+    if (i >= 0) {
+        entry = &shared_state->entries[i];
+    } else if (shared_state->num_entries < pgqs_max_entries) {
+        entry = &shared_state->entries[shared_state->num_entries];
+        memset(entry, 0, sizeof(QueryStatEntry));
+        pgqs_init_entry_atomics(entry);
+        entry->queryid = queryid;
+        entry->text_id = text_id;
+        entry->min_time = duration;
+        entry->max_time = duration;
+        shared_state->num_entries++;
+        elog(DEBUG1, "pg_query_stats: added new entry for: %.*s", query_len, query);
+    }
+
+    if (entry) {
+        entry->calls++;
+        entry->total_time += duration;
+        if (duration < entry->min_time)
+            entry->min_time = duration;
+        if (duration > entry->max_time)
+            entry->max_time = duration;
+
+        entry->temp_blks_read += stats->bufusage.temp_blks_read;
+        entry->temp_blks_written += stats->bufusage.temp_blks_written;
+        if (stats->spilled || stats->bufusage.temp_blks_written > 0)
+            entry->spill_calls++;
+
+        if (stats->workers_planned > 0) {
+            entry->parallel_calls++;
+            entry->workers_planned += stats->workers_planned;
+            entry->workers_launched += stats->workers_launched;
+            entry->leader_time += stats->leader_time;
+            entry->worker_time += stats->worker_time;
+            entry->gather_time += stats->gather_time;
+        }
+
+        if (stats->send_timed) {
+            entry->send_calls++;
+            entry->send_exec_time += duration;
+            entry->send_time += stats->send_time;
+            entry->rows_sent += stats->rows_sent;
+            entry->bytes_sent += stats->bytes_sent;
+        }
+
+        if (stats->concurrency_bucket >= 0)
+            entry->concurrency_hist_time[stats->concurrency_bucket] += duration;
+
+        if (stats->plan_kind == PGQS_PLAN_GENERIC) {
+            entry->generic_calls++;
+            entry->generic_time += duration;
+        } else if (stats->plan_kind == PGQS_PLAN_CUSTOM) {
+            entry->custom_calls++;
+            entry->custom_time += duration;
+        }
+
+        if (stats->jit.created_functions > 0) {
+            entry->jit_calls++;
+            entry->jit_exec_time += duration;
+            entry->jit_functions += stats->jit.created_functions;
+            entry->jit_generation_time += INSTR_TIME_GET_MILLISEC(stats->jit.generation_counter);
+#if PG_VERSION_NUM >= 170000
+            entry->jit_deform_time += INSTR_TIME_GET_MILLISEC(stats->jit.deform_counter);
+#endif
+            entry->jit_inlining_time += INSTR_TIME_GET_MILLISEC(stats->jit.inlining_counter);
+            entry->jit_optimization_time += INSTR_TIME_GET_MILLISEC(stats->jit.optimization_counter);
+            entry->jit_emission_time += INSTR_TIME_GET_MILLISEC(stats->jit.emission_counter);
+        }
+
+        if (stats->sampled) {
+            entry->sampled_calls++;
+            entry->sum_qerror += stats->max_qerror;
+            if (stats->max_qerror > entry->max_qerror)
+                entry->max_qerror = stats->max_qerror;
+            if (stats->peak_mem_kb > entry->peak_mem_kb)
+                entry->peak_mem_kb = stats->peak_mem_kb;
+            if (stats->suggested_work_mem_kb > entry->suggested_work_mem_kb)
+                entry->suggested_work_mem_kb = stats->suggested_work_mem_kb;
+        }
+    }
+
+    LWLockRelease(shared_state->lock);
+}
+
+/* Scanned relation of a scan node, or InvalidOid */
+static Oid pgqs_scan_relid(PlanState *planstate)
+{
+    Relation rel;
+
+    switch (nodeTag(planstate->plan))
     {
-        pgqsQueryEntry *e = (pgqsQueryEntry *) lfirst(lc);
-        if (e->query == queryDesc)
+        case T_SeqScan:
+        case T_SampleScan:
+        case T_IndexScan:
+        case T_IndexOnlyScan:
+        case T_BitmapHeapScan:
+        case T_TidScan:
+        case T_TidRangeScan:
+        case T_ForeignScan:
+            rel = ((ScanState *) planstate)->ss_currentRelation;
+            return rel ? RelationGetRelid(rel) : InvalidOid;
+        default:
+            return InvalidOid;
+    }
+}
+
+/*
+ * A sort that went to disk needs more than its on-disk size in memory:
+ * in-memory tuples carry per-tuple overhead the tape format does not, so
+ * the spilled size is doubled.
+ */
+static void pgqs_note_sort_memory(TuplesortInstrumentation *stats, pgqsNodeSample *sample)
+{
+    if (stats->spaceType == SORT_SPACE_TYPE_DISK)
+        sample->needed_kb = Max(sample->needed_kb, stats->spaceUsed * 2);
+    else
+        sample->mem_kb = Max(sample->mem_kb, stats->spaceUsed);
+}
+
+/*
+ * A batched hash join held one batch at a time; all batches together is
+ * what a single in-memory batch would have needed.  Hash nodes may use
+ * hash_mem_multiplier times work_mem.
+ */
+static void pgqs_note_hash_memory(HashInstrumentation *hinstrument, pgqsNodeSample *sample)
+{
+    int64 peak_kb = (int64) (hinstrument->space_peak / 1024);
+
+    sample->mem_kb = Max(sample->mem_kb, peak_kb);
+    if (hinstrument->nbatch > 1)
+        sample->needed_kb = Max(sample->needed_kb,
+                                (int64) (peak_kb * hinstrument->nbatch / hash_mem_multiplier));
+}
+
+/* Hash aggregation spills whatever did not fit next to its peak memory */
+static void pgqs_note_agg_memory(Size hash_mem_peak, uint64 hash_disk_used, pgqsNodeSample *sample)
+{
+    int64 peak_kb = (int64) (hash_mem_peak / 1024);
+
+    sample->mem_kb = Max(sample->mem_kb, peak_kb);
+    if (hash_disk_used > 0)
+        sample->needed_kb = Max(sample->needed_kb,
+                                (int64) ((peak_kb + hash_disk_used) / hash_mem_multiplier));
+}
+
+/*
+ * q-error of a row estimate: the factor by which it is off in either
+ * direction.  Both sides are clamped to one row, as the planner does.
+ */
+static double pgqs_qerror(double estimated, double actual)
+{
+    estimated = Max(estimated, 1.0);
+    actual = Max(actual, 1.0);
+
+    return estimated > actual ? estimated / actual : actual / estimated;
+}
+
+/* Sort, hash and hash aggregate memory use of a node, largest process wins */
+static void pgqs_node_memory(PlanState *planstate, pgqsNodeSample *sample)
+{
+    int n;
+
+    switch (nodeTag(planstate->plan))
+    {
+        case T_Sort:
         {
-            entry = e;
+            SortState *sortstate = (SortState *) planstate;
+            TuplesortInstrumentation stats;
+
+            if (sortstate->sort_Done && sortstate->tuplesortstate != NULL)
+            {
+                tuplesort_get_stats((Tuplesortstate *) sortstate->tuplesortstate, &stats);
+                pgqs_note_sort_memory(&stats, sample);
+            }
+            if (sortstate->shared_info)
+            {
+                for (n = 0; n < sortstate->shared_info->num_workers; n++)
+                {
+                    stats = sortstate->shared_info->sinstrument[n];
+                    if (stats.sortMethod != SORT_TYPE_STILL_IN_PROGRESS)
+                        pgqs_note_sort_memory(&stats, sample);
+                }
+            }
+            break;
+        }
+        case T_Hash:
+        {
+            HashState *hashstate = (HashState *) planstate;
+
+            if (hashstate->hinstrument)
+                pgqs_note_hash_memory(hashstate->hinstrument, sample);
+            if (hashstate->shared_info)
+            {
+                for (n = 0; n < hashstate->shared_info->num_workers; n++)
+                    pgqs_note_hash_memory(&hashstate->shared_info->hinstrument[n], sample);
+            }
+            break;
+        }
+        case T_Agg:
+        {
+            AggState *aggstate = (AggState *) planstate;
+
+            pgqs_note_agg_memory(aggstate->hash_mem_peak, aggstate->hash_disk_used, sample);
+            if (aggstate->shared_info)
+            {
+                for (n = 0; n < aggstate->shared_info->num_workers; n++)
+                {
+                    AggregateInstrumentation *si = &aggstate->shared_info->sinstrument[n];
+
+                    pgqs_note_agg_memory(si->hash_mem_peak, si->hash_disk_used, sample);
+                }
+            }
             break;
         }
+        default:
+            break;
     }
+}
 
-    if (entry)
+/* User columns referenced by the filter of a Seq Scan, ascending */
+static void pgqs_seq_scan_filter(PlanState *planstate, pgqsNodeSample *sample)
+{
+    Plan *plan = planstate->plan;
+    Bitmapset *attrs = NULL;
+    int member = -1;
+
+    sample->nfilter_cols = -1;
+
+    if (!IsA(plan, SeqScan) || plan->qual == NIL)
+        return;
+
+    pull_varattnos((Node *) plan->qual, ((Scan *) plan)->scanrelid, &attrs);
+
+    sample->nfilter_cols = 0;
+    while ((member = bms_next_member(attrs, member)) >= 0 &&
+           sample->nfilter_cols < MAX_FILTER_COLUMNS)
     {
-        double duration_ms = (double)(GetCurrentTimestamp() - entry->start_time) / 1000.0;
+        AttrNumber attno = member + FirstLowInvalidHeapAttributeNumber;
 
-        elog(LOG, "pg_query_stats: query duration: %.3f ms for: %s",
-             duration_ms, queryDesc->sourceText);
+        if (attno > 0)
+            sample->filter_cols[sample->nfilter_cols++] = attno;
+    }
+    bms_free(attrs);
+
+    if (sample->nfilter_cols == 0)
+        sample->nfilter_cols = -1;
+}
+
+/*
+ * Workers planned and launched by Gather and Gather Merge nodes.  With
+ * instrumentation, the subtree below the Gather holds the leader's and the
+ * workers' time combined, and worker_instrument the workers' share.
+ */
+static bool pgqs_gather_walker(PlanState *planstate, void *context)
+{
+    pgqsExecStats *stats = (pgqsExecStats *) context;
+    PlanState *child = outerPlanState(planstate);
+
+    if (IsA(planstate, GatherState) || IsA(planstate, GatherMergeState))
+    {
+        if (IsA(planstate, GatherState)) {
+            stats->workers_planned += ((Gather *) planstate->plan)->num_workers;
+            stats->workers_launched += ((GatherState *) planstate)->nworkers_launched;
+        } else {
+            stats->workers_planned += ((GatherMerge *) planstate->plan)->num_workers;
+            stats->workers_launched += ((GatherMergeState *) planstate)->nworkers_launched;
+        }
+
+        if (stats->sampled && planstate->instrument && child && child->instrument)
+        {
+            double worker_total = 0.0;
+            int n;
+
+            InstrEndLoop(planstate->instrument);
+            InstrEndLoop(child->instrument);
 
-        if (duration_ms >= pgqs_min_duration)
-            pgqs_update_stats(queryDesc->sourceText, duration_ms);
+            if (child->worker_instrument)
+            {
+                for (n = 0; n < child->worker_instrument->num_workers; n++)
+                    worker_total += child->worker_instrument->instrument[n].total;
+            }
 
-        query_times_list = list_delete_ptr(query_times_list, entry);
-        pfree(entry);
+            stats->gather_time += planstate->instrument->total * 1000.0;
+            stats->worker_time += worker_total * 1000.0;
+            stats->leader_time += Max(child->instrument->total - worker_total, 0.0) * 1000.0;
+        }
     }
-    else
+
+    return planstate_tree_walker(planstate, pgqs_gather_walker, context);
+}
+
+/* Sums the inclusive time of the direct children of a node */
+static bool pgqs_child_time_walker(PlanState *planstate, void *context)
+{
+    double *child_time = (double *) context;
+
+    if (planstate->instrument)
     {
-        elog(LOG, "pg_query_stats: no start time found for query: %s",
-             queryDesc->sourceText);
+        InstrEndLoop(planstate->instrument);
+        *child_time += planstate->instrument->total;
     }
+    return false;
 }
 
-/* pg_query_stats */
-Datum pg_query_stats(PG_FUNCTION_ARGS) {
-    FuncCallContext *funcctx;
-    MemoryContext oldcontext;
+/* Records one sample per executed plan node */
+static bool pgqs_plan_node_walker(PlanState *planstate, void *context)
+{
+    List **samples = (List **) context;
+    Instrumentation *instr = planstate->instrument;
 
-    if (SRF_IS_FIRSTCALL()) {
-        TupleDesc tupdesc;
+    if (instr)
+    {
+        InstrEndLoop(instr);
 
-        funcctx = SRF_FIRSTCALL_INIT();
-        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+        if (instr->nloops > 0)
+        {
+            pgqsNodeSample *sample = palloc(sizeof(pgqsNodeSample));
+            double child_time = 0.0;
 
-        tupdesc = CreateTemplateTupleDesc(5);
-        TupleDescInitEntry(tupdesc, 1, "query_text", TEXTOID, -1, 0);
-        TupleDescInitEntry(tupdesc, 2, "calls", INT8OID, -1, 0);
-        TupleDescInitEntry(tupdesc, 3, "total_time", FLOAT8OID, -1, 0);
-        TupleDescInitEntry(tupdesc, 4, "min_time", FLOAT8OID, -1, 0);
-        TupleDescInitEntry(tupdesc, 5, "max_time", FLOAT8OID, -1, 0);
+            planstate_tree_walker(planstate, pgqs_child_time_walker, &child_time);
 
-        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
-        MemoryContextSwitchTo(oldcontext);
+            sample->node_type = nodeTag(planstate->plan);
+            sample->relid = pgqs_scan_relid(planstate);
+            sample->loops = (uint64) instr->nloops;
+            sample->time = Max(instr->total - child_time, 0.0) * 1000.0;
+            sample->rows = instr->ntuples;
+            sample->qerror = pgqs_qerror(planstate->plan->plan_rows,
+                                         instr->ntuples / instr->nloops);
+            sample->mem_kb = 0;
+            sample->needed_kb = 0;
+            sample->rows_removed = instr->nfiltered1;
+            pgqs_node_memory(planstate, sample);
+            pgqs_seq_scan_filter(planstate, sample);
+            *samples = lappend(*samples, sample);
+        }
     }
 
-    funcctx = SRF_PERCALL_SETUP();
+    return planstate_tree_walker(planstate, pgqs_plan_node_walker, context);
+}
 
-    LWLockAcquire(shared_state->lock, LW_SHARED);
+/* Fold filtered Seq Scans of a sampled execution into the hotspot table */
+static void pgqs_collect_seq_scans(List *samples)
+{
+    ListCell *lc;
+    bool locked = false;
 
-    if (funcctx->call_cntr < shared_state->num_entries) {
-        Datum values[5];
-        bool nulls[5] = {false};
-        HeapTuple tuple;
-        QueryStatEntry *entry = &shared_state->entries[funcctx->call_cntr];
+    foreach(lc, samples)
+    {
+        pgqsNodeSample *sample = (pgqsNodeSample *) lfirst(lc);
+        SeqScanStatEntry *entry = NULL;
+        int i;
 
-        values[0] = CStringGetTextDatum(entry->query_text);
-        values[1] = Int64GetDatum(entry->calls);
-        values[2] = Float8GetDatum(entry->total_time);
-        values[3] = Float8GetDatum(entry->min_time);
-        values[4] = Float8GetDatum(entry->max_time);
+        if (sample->nfilter_cols <= 0 || !OidIsValid(sample->relid))
+            continue;
 
-        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
-        LWLockRelease(shared_state->lock);
-        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+        if (!locked) {
+            LWLockAcquire(seq_scan_state->lock, LW_EXCLUSIVE);
+            locked = true;
+        }
+
+        for (i = 0; i < seq_scan_state->num_entries; i++) {
+            SeqScanStatEntry *e = &seq_scan_state->entries[i];
+
+            if (e->relid == sample->relid && e->dbid == MyDatabaseId &&
+                e->nattnums == sample->nfilter_cols &&
+                memcmp(e->attnums, sample->filter_cols,
+                       sample->nfilter_cols * sizeof(AttrNumber)) == 0) {
+                entry = e;
+                break;
+            }
+        }
+
+        if (!entry) {
+            if (seq_scan_state->num_entries >= MAX_SEQ_SCAN_ENTRIES)
+                continue;
+            entry = &seq_scan_state->entries[seq_scan_state->num_entries++];
+            memset(entry, 0, sizeof(SeqScanStatEntry));
+            entry->dbid = MyDatabaseId;
+            entry->relid = sample->relid;
+            entry->nattnums = sample->nfilter_cols;
+            memcpy(entry->attnums, sample->filter_cols,
+                   sample->nfilter_cols * sizeof(AttrNumber));
+        }
+
+        entry->calls++;
+        entry->rows_returned += sample->rows;
+        entry->rows_removed += sample->rows_removed;
+        entry->total_time += sample->time;
     }
 
-    LWLockRelease(shared_state->lock);
-    SRF_RETURN_DONE(funcctx);
+    if (locked)
+        LWLockRelease(seq_scan_state->lock);
 }
 
-/* pg_query_stats_reset */
-Datum pg_query_stats_reset(PG_FUNCTION_ARGS) {
-    LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
-    shared_state->num_entries = 0;
-    LWLockRelease(shared_state->lock);
+/*
+ * Fold the node timings of a sampled execution into the plan node profile
+ * and report the worst row estimate of the plan in stats.
+ */
+static void pgqs_collect_plan_nodes(QueryDesc *queryDesc, pgqsExecStats *stats)
+{
+    List *samples = NIL;
+    ListCell *lc;
 
-    PG_RETURN_VOID();
+    if (!plan_node_state)
+        return;
+
+    pgqs_plan_node_walker(queryDesc->planstate, &samples);
+
+    foreach(lc, samples)
+    {
+        pgqsNodeSample *sample = (pgqsNodeSample *) lfirst(lc);
+
+        if (sample->qerror > stats->max_qerror)
+            stats->max_qerror = sample->qerror;
+        stats->peak_mem_kb = Max(stats->peak_mem_kb, Max(sample->mem_kb, sample->needed_kb));
+        if (sample->needed_kb > 0)
+            stats->spilled = true;
+        stats->suggested_work_mem_kb = Max(stats->suggested_work_mem_kb, sample->needed_kb);
+    }
+
+    LWLockAcquire(plan_node_state->lock, LW_EXCLUSIVE);
+
+    foreach(lc, samples)
+    {
+        pgqsNodeSample *sample = (pgqsNodeSample *) lfirst(lc);
+        PlanNodeStatEntry *entry = NULL;
+        int i;
+
+        for (i = 0; i < plan_node_state->num_entries; i++) {
+            PlanNodeStatEntry *e = &plan_node_state->entries[i];
+
+            if (e->node_type == sample->node_type && e->relid == sample->relid &&
+                e->dbid == MyDatabaseId) {
+                entry = e;
+                break;
+            }
+        }
+
+        if (!entry) {
+            if (plan_node_state->num_entries >= MAX_PLAN_NODE_ENTRIES)
+                continue;
+            entry = &plan_node_state->entries[plan_node_state->num_entries++];
+            memset(entry, 0, sizeof(PlanNodeStatEntry));
+            entry->dbid = MyDatabaseId;
+            entry->relid = sample->relid;
+            entry->node_type = sample->node_type;
+        }
+
+        entry->calls++;
+        entry->loops += sample->loops;
+        entry->total_time += sample->time;
+        entry->rows += sample->rows;
+        entry->sum_qerror += sample->qerror;
+        if (sample->qerror > entry->max_qerror)
+            entry->max_qerror = sample->qerror;
+    }
+
+    LWLockRelease(plan_node_state->lock);
+
+    pgqs_collect_seq_scans(samples);
+
+    list_free_deep(samples);
 }
 
-/* Cleanup hook */
-void _PG_fini(void) {
-    ExecutorStart_hook = prev_ExecutorStart;
-    ExecutorFinish_hook = prev_ExecutorFinish;
+/* Split an execution's time and buffers between the relations it references */
+static void pgqs_collect_relations(QueryDesc *queryDesc, const pgqsExecStats *stats)
+{
+    List *relids = NIL;
+    ListCell *lc;
+    double share;
+
+    foreach(lc, queryDesc->plannedstmt->rtable)
+    {
+        RangeTblEntry *rte = lfirst_node(RangeTblEntry, lc);
+
+        if (rte->rtekind == RTE_RELATION)
+            relids = list_append_unique_oid(relids, rte->relid);
+    }
+
+    if (relids == NIL)
+        return;
+
+    share = 1.0 / list_length(relids);
+
+    LWLockAcquire(relation_state->lock, LW_EXCLUSIVE);
+
+    foreach(lc, relids)
+    {
+        Oid relid = lfirst_oid(lc);
+        RelationStatEntry *entry = NULL;
+        int i;
+
+        for (i = 0; i < relation_state->num_entries; i++) {
+            RelationStatEntry *e = &relation_state->entries[i];
+
+            if (e->relid == relid && e->dbid == MyDatabaseId) {
+                entry = e;
+                break;
+            }
+        }
+
+        if (!entry) {
+            if (relation_state->num_entries >= MAX_RELATION_ENTRIES)
+                continue;
+            entry = &relation_state->entries[relation_state->num_entries++];
+            memset(entry, 0, sizeof(RelationStatEntry));
+            entry->dbid = MyDatabaseId;
+            entry->relid = relid;
+        }
+
+        entry->calls++;
+        entry->total_time += stats->duration * share;
+        entry->shared_blks_hit += stats->bufusage.shared_blks_hit * share;
+        entry->shared_blks_read += stats->bufusage.shared_blks_read * share;
+        entry->shared_blks_dirtied += stats->bufusage.shared_blks_dirtied * share;
+        entry->shared_blks_written += stats->bufusage.shared_blks_written * share;
+    }
+
+    LWLockRelease(relation_state->lock);
+
+    list_free(relids);
+}
+
+/* Collect the distinct indexes scanned by a plan into a List of Oids */
+static bool pgqs_index_walker(PlanState *planstate, void *context)
+{
+    List **indexids = (List **) context;
+    Plan *plan = planstate->plan;
+
+    if (IsA(plan, IndexScan))
+        *indexids = list_append_unique_oid(*indexids, ((IndexScan *) plan)->indexid);
+    else if (IsA(plan, IndexOnlyScan))
+        *indexids = list_append_unique_oid(*indexids, ((IndexOnlyScan *) plan)->indexid);
+    else if (IsA(plan, BitmapIndexScan))
+        *indexids = list_append_unique_oid(*indexids, ((BitmapIndexScan *) plan)->indexid);
+
+    return planstate_tree_walker(planstate, pgqs_index_walker, context);
+}
+
+/* Charge an execution to each index its plan uses */
+static void pgqs_collect_indexes(QueryDesc *queryDesc, uint64 queryid, double duration)
+{
+    List *indexids = NIL;
+    ListCell *lc;
+
+    if (!queryDesc->planstate)
+        return;
+
+    pgqs_index_walker(queryDesc->planstate, &indexids);
+
+    if (indexids == NIL)
+        return;
+
+    LWLockAcquire(index_state->lock, LW_EXCLUSIVE);
+
+    foreach(lc, indexids)
+    {
+        Oid indexid = lfirst_oid(lc);
+        IndexStatEntry *entry = NULL;
+        int i;
+
+        for (i = 0; i < index_state->num_entries; i++) {
+            IndexStatEntry *e = &index_state->entries[i];
+
+            if (e->indexid == indexid && e->queryid == queryid && e->dbid == MyDatabaseId) {
+                entry = e;
+                break;
+            }
+        }
+
+        if (!entry) {
+            if (index_state->num_entries >= MAX_INDEX_ENTRIES)
+                continue;
+            entry = &index_state->entries[index_state->num_entries++];
+            memset(entry, 0, sizeof(IndexStatEntry));
+            entry->dbid = MyDatabaseId;
+            entry->indexid = indexid;
+            entry->queryid = queryid;
+        }
+
+        entry->calls++;
+        entry->total_time += duration;
+    }
+
+    LWLockRelease(index_state->lock);
+
+    list_free(indexids);
+}
+
+/* Plan node names as shown by EXPLAIN */
+static const char *pgqs_node_type_name(NodeTag node_type)
+{
+    switch (node_type)
+    {
+        case T_Result: return "Result";
+        case T_ProjectSet: return "ProjectSet";
+        case T_ModifyTable: return "ModifyTable";
+        case T_Append: return "Append";
+        case T_MergeAppend: return "Merge Append";
+        case T_RecursiveUnion: return "Recursive Union";
+        case T_BitmapAnd: return "BitmapAnd";
+        case T_BitmapOr: return "BitmapOr";
+        case T_NestLoop: return "Nested Loop";
+        case T_MergeJoin: return "Merge Join";
+        case T_HashJoin: return "Hash Join";
+        case T_SeqScan: return "Seq Scan";
+        case T_SampleScan: return "Sample Scan";
+        case T_Gather: return "Gather";
+        case T_GatherMerge: return "Gather Merge";
+        case T_IndexScan: return "Index Scan";
+        case T_IndexOnlyScan: return "Index Only Scan";
+        case T_BitmapIndexScan: return "Bitmap Index Scan";
+        case T_BitmapHeapScan: return "Bitmap Heap Scan";
+        case T_TidScan: return "Tid Scan";
+        case T_TidRangeScan: return "Tid Range Scan";
+        case T_SubqueryScan: return "Subquery Scan";
+        case T_FunctionScan: return "Function Scan";
+        case T_TableFuncScan: return "Table Function Scan";
+        case T_ValuesScan: return "Values Scan";
+        case T_CteScan: return "CTE Scan";
+        case T_NamedTuplestoreScan: return "Named Tuplestore Scan";
+        case T_WorkTableScan: return "WorkTable Scan";
+        case T_ForeignScan: return "Foreign Scan";
+        case T_CustomScan: return "Custom Scan";
+        case T_Material: return "Materialize";
+        case T_Memoize: return "Memoize";
+        case T_Sort: return "Sort";
+        case T_IncrementalSort: return "Incremental Sort";
+        case T_Group: return "Group";
+        case T_Agg: return "Aggregate";
+        case T_WindowAgg: return "WindowAgg";
+        case T_Unique: return "Unique";
+        case T_SetOp: return "SetOp";
+        case T_LockRows: return "LockRows";
+        case T_Limit: return "Limit";
+        case T_Hash: return "Hash";
+        default: return "???";
+    }
+}
+
+/*
+ * Generic or custom cached plan?  Only statements with bound parameters
+ * are of interest, and only when the plan is the one the active portal got
+ * from the plan cache.  The plan cache's own choice is read from the plan
+ * source: its generic plan is generic, any other plan custom.  Plan
+ * sources are found for prepared statements run by EXECUTE or bound by
+ * name over the extended protocol; the unnamed protocol statement is
+ * planned for one execution and counts as uncached.
+ */
+static pgqsPlanKind pgqs_plan_kind(QueryDesc *queryDesc)
+{
+    CachedPlanSource *plansource = execute_plansource;
+    CachedPlan *cplan;
+
+    if (!queryDesc->params || queryDesc->params->numParams == 0)
+        return PGQS_PLAN_UNCACHED;
+
+    if (!ActivePortal || !ActivePortal->cplan)
+        return PGQS_PLAN_UNCACHED;
+
+    cplan = ActivePortal->cplan;
+    if (!list_member_ptr(cplan->stmt_list, queryDesc->plannedstmt))
+        return PGQS_PLAN_UNCACHED;
+
+    if (ActivePortal->prepStmtName && ActivePortal->prepStmtName[0] != '\0') {
+        PreparedStatement *prepared = FetchPreparedStatement(ActivePortal->prepStmtName, false);
+
+        plansource = prepared ? prepared->plansource : NULL;
+    }
+
+    /* A portal opened below the EXECUTE runs some other statement */
+    if (!plansource || strcmp(plansource->query_string, queryDesc->sourceText) != 0)
+        return PGQS_PLAN_UNCACHED;
+
+    return plansource->gplan == cplan ? PGQS_PLAN_GENERIC : PGQS_PLAN_CUSTOM;
+}
+
+/* This backend's slot, or NULL */
+static pgqsBackendSlot *pgqs_my_slot(void)
+{
+    int procno;
+
+    if (!backend_slots || !MyProc)
+        return NULL;
+
+    procno = PGQS_PROCNO(MyProc);
+    if (procno < 0 || procno >= num_backend_slots)
+        return NULL;
+
+    return &backend_slots[procno];
+}
+
+/* Publish the innermost running statement in this backend's slot */
+static void pgqs_publish_current(void)
+{
+    pgqsQueryEntry *current;
+    pgqsBackendSlot *slot = pgqs_my_slot();
+
+    if (!slot)
+        return;
+
+    current = query_times_list ? (pgqsQueryEntry *) llast(query_times_list) : NULL;
+
+    slot->changecount++;
+    pg_write_barrier();
+
+    pg_atomic_write_u64(&slot->queryid, current ? current->queryid : 0);
+    slot->dbid = MyDatabaseId;
+    slot->nesting_level = current ? list_length(query_times_list) - 1 : 0;
+    slot->start_time = current ? current->start_time : 0;
+
+    pg_write_barrier();
+    slot->changecount++;
+}
+
+/* Consistent copy of another backend's slot */
+static void pgqs_read_slot(volatile pgqsBackendSlot *slot, pgqsSlotCopy *copy)
+{
+    for (;;) {
+        uint32 before = slot->changecount;
+
+        pg_read_barrier();
+        copy->queryid = pg_atomic_read_u64((pg_atomic_uint64 *) &slot->queryid);
+        copy->dbid = slot->dbid;
+        copy->nesting_level = slot->nesting_level;
+        copy->start_time = slot->start_time;
+        memcpy(&copy->session, (pgqsSessionStats *) &slot->session, sizeof(pgqsSessionStats));
+        pg_read_barrier();
+
+        if (before == slot->changecount && (before & 1) == 0)
+            break;
+
+        CHECK_FOR_INTERRUPTS();
+    }
+}
+
+/* Client address of this session, "local" for Unix sockets */
+static void pgqs_client_addr(char *buf, size_t len)
+{
+    strlcpy(buf, "", len);
+
+    if (!MyProcPort)
+        return;
+
+    if (MyProcPort->raddr.addr.ss_family == AF_UNIX)
+        strlcpy(buf, "local", len);
+    else if (pg_getnameinfo_all(&MyProcPort->raddr.addr, MyProcPort->raddr.salen,
+                                buf, len, NULL, 0,
+                                NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+        strlcpy(buf, "", len);
+}
+
+/* Roll this session's totals into its application's entry at exit */
+static void pgqs_session_exit(int code, Datum arg)
+{
+    pgqsBackendSlot *slot = pgqs_my_slot();
+    pgqsSessionStats *session;
+    ApplicationStatEntry *entry = NULL;
+    int i;
+
+    if (!slot || !application_state || !session_started)
+        return;
+
+    session = &slot->session;
+
+    LWLockAcquire(application_state->lock, LW_EXCLUSIVE);
+
+    for (i = 0; i < application_state->num_entries; i++) {
+        ApplicationStatEntry *e = &application_state->entries[i];
+
+        if (strcmp(e->application_name, session->application_name) == 0 &&
+            strcmp(e->client_addr, session->client_addr) == 0) {
+            entry = e;
+            break;
+        }
+    }
+
+    if (!entry && application_state->num_entries < MAX_APPLICATION_ENTRIES) {
+        entry = &application_state->entries[application_state->num_entries++];
+        memset(entry, 0, sizeof(ApplicationStatEntry));
+        strlcpy(entry->application_name, session->application_name, NAMEDATALEN);
+        strlcpy(entry->client_addr, session->client_addr, CLIENT_ADDR_LENGTH);
+    }
+
+    if (entry) {
+        entry->sessions++;
+        entry->session_time += (double) (GetCurrentTimestamp() - session->session_start) / 1000.0;
+        entry->statements += session->statements;
+        entry->total_time += session->total_time;
+        entry->rows += session->rows;
+        entry->shared_blks_hit += session->shared_blks_hit;
+        entry->shared_blks_read += session->shared_blks_read;
+        entry->shared_blks_written += session->shared_blks_written;
+    }
+
+    LWLockRelease(application_state->lock);
+
+    slot->changecount++;
+    pg_write_barrier();
+    memset(session, 0, sizeof(pgqsSessionStats));
+    pg_write_barrier();
+    slot->changecount++;
+
+    session_started = false;
+}
+
+/* Add a finished top-level statement to this session's totals */
+static void pgqs_session_account(double duration, uint64 rows, const BufferUsage *bufusage)
+{
+    pgqsBackendSlot *slot = pgqs_my_slot();
+    pgqsSessionStats *session;
+
+    if (!slot || IsParallelWorker())
+        return;
+
+    session = &slot->session;
+
+    slot->changecount++;
+    pg_write_barrier();
+
+    if (!session_started) {
+        /* The slot may hold leftovers of a previous backend */
+        memset(session, 0, sizeof(pgqsSessionStats));
+        session->pid = MyProcPid;
+        session->session_start = MyStartTimestamp;
+        pgqs_client_addr(session->client_addr, CLIENT_ADDR_LENGTH);
+    }
+
+    strlcpy(session->application_name, application_name ? application_name : "", NAMEDATALEN);
+    session->statements++;
+    session->total_time += duration;
+    session->rows += rows;
+    session->shared_blks_hit += bufusage->shared_blks_hit;
+    session->shared_blks_read += bufusage->shared_blks_read;
+    session->shared_blks_written += bufusage->shared_blks_written;
+
+    pg_write_barrier();
+    slot->changecount++;
+
+    if (!session_started) {
+        before_shmem_exit(pgqs_session_exit, (Datum) 0);
+        session_started = true;
+    }
+}
+
+/*
+ * Remember the SQLSTATE of errors for the abort that follows.  The hook only
+ * sees errors written to the server log, so with log_min_messages above
+ * ERROR, or for errors caught by a PL/pgSQL handler, failures are recorded
+ * with SQLSTATE 0 and retryable aborts are not recognized.
+ */
+static void pgqs_emit_log(ErrorData *edata)
+{
+    if (edata->elevel >= ERROR)
+        last_errcode = edata->sqlerrcode;
+
+    if (prev_emit_log_hook)
+        prev_emit_log_hook(edata);
+}
+
+/* Record an execution cut short by an error */
+/* The failure entry of a statement and SQLSTATE, or NULL */
+static FailureStatEntry *pgqs_lookup_failure(uint64 queryid, int sqlerrcode)
+{
+    int i;
+
+    for (i = 0; i < failure_state->num_entries; i++) {
+        FailureStatEntry *e = &failure_state->entries[i];
+
+        if (e->queryid == queryid && e->sqlerrcode == sqlerrcode)
+            return e;
+    }
+    return NULL;
+}
+
+static void pgqs_record_failure(pgqsQueryEntry *qentry, TimestampTz now)
+{
+    FailureStatEntry *entry;
+    double elapsed = (double) (now - qentry->start_time) / 1000.0;
+    int text_id = -1;
+
+    if (!failure_state || IsParallelWorker())
+        return;
+
+    LWLockAcquire(failure_state->lock, LW_EXCLUSIVE);
+
+    entry = pgqs_lookup_failure(qentry->queryid, last_errcode);
+
+    /*
+     * As in pgqs_update_stats(), a new entry's text is stored without
+     * holding the table lock.  A reset clears failures with the statement
+     * table and the texts, and bumps the statement table's generation.
+     */
+    while (!entry && failure_state->num_entries < MAX_FAILURE_ENTRIES) {
+        uint64 generation = shared_state->generation;
+
+        LWLockRelease(failure_state->lock);
+        text_id = pgqs_store_text(qentry->queryid, qentry->query_text,
+                                  strlen(qentry->query_text));
+        LWLockAcquire(failure_state->lock, LW_EXCLUSIVE);
+
+        if (shared_state->generation != generation) {
+            text_id = -1;
+            entry = pgqs_lookup_failure(qentry->queryid, last_errcode);
+            continue;
+        }
+
+        entry = pgqs_lookup_failure(qentry->queryid, last_errcode);
+        if (entry || failure_state->num_entries >= MAX_FAILURE_ENTRIES) {
+            pgqs_release_text(text_id);
+            text_id = -1;
+            break;
+        }
+
+        entry = &failure_state->entries[failure_state->num_entries++];
+        memset(entry, 0, sizeof(FailureStatEntry));
+        entry->queryid = qentry->queryid;
+        entry->sqlerrcode = last_errcode;
+        entry->text_id = text_id;
+    }
+
+    if (entry) {
+        entry->failures++;
+        entry->total_time += elapsed;
+        if (elapsed > entry->max_time)
+            entry->max_time = elapsed;
+    }
+
+    LWLockRelease(failure_state->lock);
+}
+
+/*
+ * Forget statements started at or below the given transaction nest level;
+ * an abort means their ExecutorFinish will never run, so they are recorded
+ * as failed with the SQLSTATE of the error being handled.
+ */
+static void pgqs_discard_queries(int xact_level)
+{
+    ListCell *lc;
+    TimestampTz now = 0;
+
+    foreach(lc, query_times_list)
+    {
+        pgqsQueryEntry *entry = (pgqsQueryEntry *) lfirst(lc);
+
+        if (entry->xact_level >= xact_level)
+        {
+            if (now == 0)
+                now = GetCurrentTimestamp();
+            pgqs_record_failure(entry, now);
+            pgqs_leave_entry(entry);
+            query_times_list = foreach_delete_current(query_times_list, lc);
+            pfree(entry);
+        }
+    }
+
+    last_errcode = 0;
+    pgqs_publish_current();
+}
+
+/* Forget a statement that will not reach, or has passed, ExecutorFinish */
+static void pgqs_forget_query(pgqsQueryEntry *entry)
+{
+    pgqs_leave_entry(entry);
+    query_times_list = list_delete_ptr(query_times_list, entry);
+    pfree(entry);
+}
+
+/*
+ * Forget statements left over at commit.  Executions always end before a
+ * top-level commit; a procedure's COMMIT (inside CALL or DO) can happen
+ * while its loop query is still running, so nothing is dropped then.
+ */
+static void pgqs_forget_leftovers(void)
+{
+    if (utility_depth > 0 || exec_nested_level > 0 || query_times_list == NIL)
+        return;
+
+    while (query_times_list != NIL)
+        pgqs_forget_query((pgqsQueryEntry *) linitial(query_times_list));
+
+    pgqs_publish_current();
+}
+
+/* Append a finished top-level statement to the current transaction's shape */
+static void pgqs_xact_add_statement(uint64 queryid)
+{
+    int i;
+
+    if (IsParallelWorker())
+        return;
+
+    if (current_xact.nstatements < XACT_SHAPE_STATEMENTS)
+        current_xact.statements[current_xact.nstatements] = queryid;
+    current_xact.nstatements++;
+    current_xact.fingerprint = hash_combine64(current_xact.fingerprint, queryid);
+
+    for (i = 0; i < current_xact.ndistinct; i++) {
+        if (current_xact.distinct_queryids[i] == queryid) {
+            current_xact.distinct_calls[i]++;
+            return;
+        }
+    }
+    if (current_xact.ndistinct < XACT_DISTINCT_STATEMENTS) {
+        current_xact.distinct_queryids[current_xact.ndistinct] = queryid;
+        current_xact.distinct_calls[current_xact.ndistinct] = 1;
+        current_xact.ndistinct++;
+    }
+}
+
+/*
+ * Per-statement repeat counts of the ending transaction, counted in this
+ * backend and applied with atomics, so commits only share the lock.
+ */
+static void pgqs_finish_xact_statements(void)
+{
+    int i;
+
+    if (!shared_state || current_xact.ndistinct == 0)
+        return;
+
+    LWLockAcquire(shared_state->lock, LW_SHARED);
+
+    for (i = 0; i < current_xact.ndistinct; i++) {
+        int index = pgqs_lookup_entry(current_xact.distinct_queryids[i]);
+        uint64 calls = current_xact.distinct_calls[i];
+        QueryStatEntry *entry;
+        uint64 max_calls;
+
+        if (index < 0)
+            continue;
+
+        entry = &shared_state->entries[index];
+        pg_atomic_fetch_add_u64(&entry->xacts, 1);
+        pg_atomic_fetch_add_u64(&entry->xact_calls, calls);
+        pg_atomic_fetch_add_u64(&entry->xact_statements, current_xact.nstatements);
+
+        max_calls = pg_atomic_read_u64(&entry->max_xact_calls);
+        while (calls > max_calls &&
+               !pg_atomic_compare_exchange_u64(&entry->max_xact_calls, &max_calls, calls))
+            ;
+    }
+
+    LWLockRelease(shared_state->lock);
+}
+
+/* Client think-time between the last top-level statement and this one */
+static void pgqs_note_gap(TimestampTz start_time)
+{
+    double gap;
+
+    if (current_xact.last_end_time == 0 || start_time <= current_xact.last_end_time)
+        return;
+
+    gap = (double) (start_time - current_xact.last_end_time) / 1000.0;
+    current_xact.ngaps++;
+    current_xact.gap_time += gap;
+    if (gap > current_xact.max_gap)
+        current_xact.max_gap = gap;
+}
+
+/* Client think-time of the ending transaction */
+static void pgqs_finish_xact_gaps(TimestampTz now, double duration)
+{
+    XactGapStatEntry *entry = NULL;
+    const char *appname = application_name ? application_name : "";
+    TimestampTz end_time;
+    double idle = 0.0;
+    int i;
+
+    if (!xact_gap_state)
+        return;
+
+    end_time = current_xact.pre_commit_time != 0 ? current_xact.pre_commit_time : now;
+    if (current_xact.last_end_time != 0 && end_time > current_xact.last_end_time)
+        idle = (double) (end_time - current_xact.last_end_time) / 1000.0;
+
+    LWLockAcquire(xact_gap_state->lock, LW_EXCLUSIVE);
+
+    for (i = 0; i < xact_gap_state->num_entries; i++) {
+        XactGapStatEntry *e = &xact_gap_state->entries[i];
+
+        if (e->fingerprint == current_xact.fingerprint && e->dbid == MyDatabaseId &&
+            strcmp(e->application_name, appname) == 0) {
+            entry = e;
+            break;
+        }
+    }
+
+    if (!entry && xact_gap_state->num_entries < MAX_XACT_GAP_ENTRIES) {
+        entry = &xact_gap_state->entries[xact_gap_state->num_entries++];
+        memset(entry, 0, sizeof(XactGapStatEntry));
+        entry->dbid = MyDatabaseId;
+        entry->fingerprint = current_xact.fingerprint;
+        strlcpy(entry->application_name, appname, NAMEDATALEN);
+    }
+
+    if (entry) {
+        entry->xacts++;
+        entry->xact_time += duration;
+        entry->gaps += current_xact.ngaps;
+        entry->gap_time += current_xact.gap_time;
+        if (current_xact.max_gap > entry->max_gap)
+            entry->max_gap = current_xact.max_gap;
+        entry->idle_time += idle;
+    }
+
+    LWLockRelease(xact_gap_state->lock);
+}
+
+/*
+ * Fold the ending transaction into its shape's entry.  errcode is the
+ * SQLSTATE of the error that aborted it, if known.
+ */
+static void pgqs_finish_xact(bool committed, int errcode)
+{
+    XactStatEntry *entry = NULL;
+    TimestampTz now;
+    double duration;
+    bool retry;
+    bool retry_again;
+    int i;
+
+    if (current_xact.nstatements == 0 || !xact_state)
+    {
+        memset(&current_xact, 0, sizeof(current_xact));
+        return;
+    }
+
+    now = GetCurrentTimestamp();
+    duration = (double) (now - GetCurrentTransactionStartTimestamp()) / 1000.0;
+
+    pgqs_finish_xact_statements();
+    pgqs_finish_xact_gaps(now, duration);
+
+    retry = pending_retry.failed_at != 0 &&
+            current_xact.statements[0] == pending_retry.first_queryid &&
+            GetCurrentTransactionStartTimestamp() - pending_retry.failed_at <=
+            (int64) pgqs_retry_window * 1000;
+    retry_again = !committed && PGQS_RETRYABLE(errcode);
+
+    LWLockAcquire(xact_state->lock, LW_EXCLUSIVE);
+
+    for (i = 0; i < xact_state->num_entries; i++) {
+        XactStatEntry *e = &xact_state->entries[i];
+
+        if (e->fingerprint == current_xact.fingerprint && e->dbid == MyDatabaseId) {
+            entry = e;
+            break;
+        }
+    }
+
+    if (!entry && xact_state->num_entries < MAX_XACT_ENTRIES) {
+        entry = &xact_state->entries[xact_state->num_entries++];
+        memset(entry, 0, sizeof(XactStatEntry));
+        entry->dbid = MyDatabaseId;
+        entry->fingerprint = current_xact.fingerprint;
+        entry->nstatements = current_xact.nstatements;
+        memcpy(entry->statements, current_xact.statements, sizeof(entry->statements));
+        entry->min_time = duration;
+        entry->max_time = duration;
+    }
+
+    if (entry) {
+        entry->calls++;
+        entry->total_time += duration;
+        if (duration < entry->min_time)
+            entry->min_time = duration;
+        if (duration > entry->max_time)
+            entry->max_time = duration;
+
+        if (committed) {
+            entry->commits++;
+            if (current_xact.pre_commit_time != 0)
+                entry->commit_time += (double) (now - current_xact.pre_commit_time) / 1000.0;
+        } else {
+            entry->aborts++;
+            if (errcode == ERRCODE_T_R_SERIALIZATION_FAILURE)
+                entry->serialization_failures++;
+            else if (errcode == ERRCODE_T_R_DEADLOCK_DETECTED)
+                entry->deadlocks++;
+        }
+
+        if (retry)
+            entry->retries++;
+        /* Wasted time is charged once, to the shape that ended the loop */
+        if (retry && !retry_again)
+            entry->retry_wasted_time += pending_retry.wasted_time;
+    }
+
+    LWLockRelease(xact_state->lock);
+
+    if (retry_again) {
+        if (!retry)
+            pending_retry.wasted_time = 0.0;
+        pending_retry.first_queryid = current_xact.statements[0];
+        pending_retry.failed_at = now;
+        pending_retry.wasted_time += duration;
+    } else {
+        memset(&pending_retry, 0, sizeof(pending_retry));
+    }
+
+    memset(&current_xact, 0, sizeof(current_xact));
+}
+
+/*
+ * Transaction end: time the transaction and fold it into its shape; on
+ * abort, first drop statements that did not finish.
+ */
+static void pgqs_xact_callback(XactEvent event, void *arg)
+{
+    switch (event)
+    {
+        case XACT_EVENT_PRE_COMMIT:
+            current_xact.pre_commit_time = GetCurrentTimestamp();
+            break;
+        case XACT_EVENT_COMMIT:
+            pgqs_forget_leftovers();
+            pgqs_finish_xact(true, 0);
+            break;
+        case XACT_EVENT_ABORT:
+            {
+                int errcode = last_errcode;
+
+                /* The statement that failed is part of the aborted shape */
+                if (query_times_list != NIL &&
+                    ((pgqsQueryEntry *) linitial(query_times_list))->toplevel)
+                    pgqs_xact_add_statement(((pgqsQueryEntry *) linitial(query_times_list))->queryid);
+                pgqs_discard_queries(0);
+                pgqs_finish_xact(false, errcode);
+            }
+            break;
+        case XACT_EVENT_PARALLEL_ABORT:
+            pgqs_discard_queries(0);
+            break;
+        case XACT_EVENT_PREPARE:
+            /* Ends in another session's COMMIT PREPARED; not timed */
+            memset(&current_xact, 0, sizeof(current_xact));
+            break;
+        default:
+            break;
+    }
+}
+
+/* Subtransaction abort: drop statements started inside it */
+static void pgqs_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                                  SubTransactionId parentSubid, void *arg)
+{
+    if (event == SUBXACT_EVENT_ABORT_SUB)
+        pgqs_discard_queries(GetCurrentTransactionNestLevel());
+}
+
+/* ExecutorStart: store start time */
+static void pgqs_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+    pgqsQueryEntry *entry;
+    MemoryContext oldcontext;
+    bool track;
+    bool sampled = false;
+
+    /*
+     * Plain EXPLAIN starts and ends plans without running them; parallel
+     * workers' share is accounted by their leader.
+     */
+    track = pgqs_enabled && queryDesc->sourceText && !IsParallelWorker() &&
+            (eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0 &&
+            strstr(queryDesc->sourceText, "pg_query_stats") == NULL;
+
+    /* Instrumentation must be requested before the plan state is built */
+    if (track && pgqs_plan_sample_rate > 0.0 &&
+        (pgqs_plan_sample_rate >= 1.0 ||
+         pg_prng_double(&pg_global_prng_state) < pgqs_plan_sample_rate))
+    {
+        sampled = true;
+        queryDesc->instrument_options |= INSTRUMENT_TIMER | INSTRUMENT_ROWS;
+    }
+
+    if (prev_ExecutorStart)
+        prev_ExecutorStart(queryDesc, eflags);
+    else
+        standard_ExecutorStart(queryDesc, eflags);
+
+    if (!track)
+        return;
+
+    /* Outlives the query's memory, so an abort cannot leave it dangling */
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+    entry = palloc(sizeof(pgqsQueryEntry));
+    entry->query = queryDesc;
+    entry->queryid = pgqs_fingerprint(queryDesc->sourceText);
+    strlcpy(entry->query_text, queryDesc->sourceText, MAX_QUERY_TEXT_LENGTH);
+    entry->xact_level = GetCurrentTransactionNestLevel();
+    entry->toplevel = exec_nested_level == 0 && utility_depth == 0;
+    entry->start_time = GetCurrentTimestamp();
+    entry->sampled = sampled;
+    entry->bufusage_start = pgBufferUsage;
+    entry->plan_kind = pgqs_plan_kind(queryDesc);
+    entry->send_timed = false;
+    entry->send_time = 0.0;
+    entry->rows_sent = 0;
+    entry->bytes_sent = 0;
+
+    /* Plans run by a utility (EXECUTE, CTAS...) are timed with it */
+    if (entry->toplevel)
+        pgqs_note_gap(entry->start_time);
+
+    query_times_list = lappend(query_times_list, entry);
+
+    MemoryContextSwitchTo(oldcontext);
+
+    pgqs_enter_entry(entry);
+    pgqs_publish_current();
+
+    elog(DEBUG1, "pg_query_stats: stored start time for query: %s", queryDesc->sourceText);
+}
+
+/* Timing entry of a running query, or NULL */
+static pgqsQueryEntry *pgqs_find_query(QueryDesc *queryDesc)
+{
+    ListCell *lc;
+
+    foreach(lc, query_times_list)
+    {
+        pgqsQueryEntry *e = (pgqsQueryEntry *) lfirst(lc);
+        if (e->query == queryDesc)
+            return e;
+    }
+    return NULL;
+}
+
+/* Approximate size of a row: the detoasted size of its attributes */
+static uint64 pgqs_slot_bytes(TupleTableSlot *slot)
+{
+    TupleDesc tupdesc = slot->tts_tupleDescriptor;
+    uint64 bytes = 0;
+    int i;
+
+    slot_getallattrs(slot);
+
+    for (i = 0; i < tupdesc->natts; i++)
+    {
+        Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+
+        if (slot->tts_isnull[i])
+            continue;
+        if (attr->attlen > 0)
+            bytes += attr->attlen;
+        else if (attr->attlen == -1)
+            bytes += toast_raw_datum_size(slot->tts_values[i]);
+        else
+            bytes += strlen(DatumGetCString(slot->tts_values[i])) + 1;
+    }
+    return bytes;
+}
+
+static bool pgqs_timing_receive(TupleTableSlot *slot, DestReceiver *self)
+{
+    pgqsTimingDest *dest = (pgqsTimingDest *) self;
+    instr_time start;
+    instr_time end;
+    bool result;
+
+    INSTR_TIME_SET_CURRENT(start);
+    result = dest->inner->receiveSlot(slot, dest->inner);
+    INSTR_TIME_SET_CURRENT(end);
+    INSTR_TIME_ACCUM_DIFF(dest->send_time, end, start);
+
+    dest->rows++;
+    dest->bytes += pgqs_slot_bytes(slot);
+
+    return result;
+}
+
+static void pgqs_timing_startup(DestReceiver *self, int operation, TupleDesc typeinfo)
+{
+    pgqsTimingDest *dest = (pgqsTimingDest *) self;
+    instr_time start;
+    instr_time end;
+
+    INSTR_TIME_SET_CURRENT(start);
+    dest->inner->rStartup(dest->inner, operation, typeinfo);
+    INSTR_TIME_SET_CURRENT(end);
+    INSTR_TIME_ACCUM_DIFF(dest->send_time, end, start);
+}
+
+static void pgqs_timing_shutdown(DestReceiver *self)
+{
+    pgqsTimingDest *dest = (pgqsTimingDest *) self;
+
+    dest->inner->rShutdown(dest->inner);
+}
+
+/* The wrapped receiver belongs to the caller, which destroys it */
+static void pgqs_timing_destroy(DestReceiver *self)
+{
+}
+
+/*
+ * ExecutorRun: time the client receiver.  Portals set queryDesc->dest
+ * before every run, so the wrapper is installed here rather than at
+ * ExecutorStart, and taken out again before returning.
+ */
+static void pgqs_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+                             uint64 count, bool execute_once)
+{
+    pgqsQueryEntry *entry = NULL;
+    pgqsTimingDest *timing = NULL;
+    DestReceiver *dest = queryDesc->dest;
+
+    if (pgqs_enabled && pgqs_track_client_send && dest &&
+        (dest->mydest == DestRemote || dest->mydest == DestRemoteExecute))
+        entry = pgqs_find_query(queryDesc);
+
+    if (entry)
+    {
+        timing = palloc0(sizeof(pgqsTimingDest));
+        timing->pub.receiveSlot = pgqs_timing_receive;
+        timing->pub.rStartup = pgqs_timing_startup;
+        timing->pub.rShutdown = pgqs_timing_shutdown;
+        timing->pub.rDestroy = pgqs_timing_destroy;
+        timing->pub.mydest = dest->mydest;
+        timing->inner = dest;
+        queryDesc->dest = (DestReceiver *) timing;
+    }
+
+    exec_nested_level++;
+    PG_TRY();
+    {
+        if (prev_ExecutorRun)
+            prev_ExecutorRun(queryDesc, direction, count, execute_once);
+        else
+            standard_ExecutorRun(queryDesc, direction, count, execute_once);
+    }
+    PG_FINALLY();
+    {
+        exec_nested_level--;
+        if (timing)
+            queryDesc->dest = dest;
+    }
+    PG_END_TRY();
+
+    if (timing)
+    {
+        entry->send_timed = true;
+        entry->send_time += INSTR_TIME_GET_MILLISEC(timing->send_time);
+        entry->rows_sent += timing->rows;
+        entry->bytes_sent += timing->bytes;
+        pfree(timing);
+    }
+}
+
+/* ExecutorFinish: calculate duration */
+static void pgqs_ExecutorFinish(QueryDesc *queryDesc)
+{
+    pgqsQueryEntry *entry;
+
+    exec_nested_level++;
+    PG_TRY();
+    {
+        if (prev_ExecutorFinish)
+            prev_ExecutorFinish(queryDesc);
+        else
+            standard_ExecutorFinish(queryDesc);
+    }
+    PG_FINALLY();
+    {
+        exec_nested_level--;
+    }
+    PG_END_TRY();
+
+    if (!pgqs_enabled || !queryDesc->sourceText || IsParallelWorker())
+        return;
+
+    entry = pgqs_find_query(queryDesc);
+
+    if (entry)
+    {
+        double duration_ms = (double)(GetCurrentTimestamp() - entry->start_time) / 1000.0;
+        pgqsExecStats stats;
+
+        elog(DEBUG1, "pg_query_stats: query duration: %.3f ms for: %s",
+             duration_ms, queryDesc->sourceText);
+
+        memset(&stats, 0, sizeof(stats));
+        stats.duration = duration_ms;
+        stats.sampled = entry->sampled && queryDesc->planstate != NULL;
+        stats.plan_kind = entry->plan_kind;
+        stats.concurrency_bucket = entry->concurrency_bucket;
+        stats.send_timed = entry->send_timed;
+        stats.send_time = entry->send_time;
+        stats.rows_sent = entry->rows_sent;
+        stats.bytes_sent = entry->bytes_sent;
+        BufferUsageAccumDiff(&stats.bufusage, &pgBufferUsage, &entry->bufusage_start);
+
+        if (stats.sampled)
+            pgqs_collect_plan_nodes(queryDesc, &stats);
+
+        if (queryDesc->plannedstmt->parallelModeNeeded && queryDesc->planstate)
+            pgqs_gather_walker(queryDesc->planstate, &stats);
+
+        if (queryDesc->estate->es_jit)
+            InstrJitAgg(&stats.jit, &queryDesc->estate->es_jit->instr);
+        if (queryDesc->estate->es_jit_worker_instr)
+            InstrJitAgg(&stats.jit, queryDesc->estate->es_jit_worker_instr);
+
+        if (duration_ms >= pgqs_min_duration) {
+            pgqs_update_stats(entry, queryDesc->sourceText, &stats);
+            if (pgqs_track_relations)
+                pgqs_collect_relations(queryDesc, &stats);
+            if (pgqs_track_indexes)
+                pgqs_collect_indexes(queryDesc, entry->queryid, duration_ms);
+        }
+
+        /*
+         * Statements the client sent.  SPI statements of DO, CALL and
+         * functions, and plans run by EXECUTE or CTAS, are part of the
+         * utility running them.
+         */
+        if (exec_nested_level == 0 && utility_depth == 0) {
+            if (pgqs_capture) {
+                int len;
+                const char *text = pgqs_statement_text(queryDesc->sourceText,
+                                                       queryDesc->plannedstmt, &len);
+
+                pgqs_capture_statement(entry->start_time, duration_ms, entry->queryid,
+                                       text, len, queryDesc->params);
+            }
+            pgqs_count(&workload_state->cmdtypes[queryDesc->operation], duration_ms);
+            pgqs_count(pgqs_database_counter(), duration_ms);
+            pgqs_xact_add_statement(entry->queryid);
+            pgqs_session_account(duration_ms, queryDesc->estate->es_processed, &stats.bufusage);
+            current_xact.last_end_time = GetCurrentTimestamp();
+        }
+
+        pgqs_forget_query(entry);
+        pgqs_publish_current();
+    }
+    else
+    {
+        elog(DEBUG1, "pg_query_stats: no start time found for query: %s",
+             queryDesc->sourceText);
+    }
+}
+
+/*
+ * ExecutorEnd: drop the timing entry of an execution that did not reach
+ * ExecutorFinish, such as one stopped early or finished while tracking
+ * was disabled.
+ */
+static void pgqs_ExecutorEnd(QueryDesc *queryDesc)
+{
+    pgqsQueryEntry *entry = pgqs_find_query(queryDesc);
+
+    if (entry) {
+        pgqs_forget_query(entry);
+        pgqs_publish_current();
+    }
+
+    if (prev_ExecutorEnd)
+        prev_ExecutorEnd(queryDesc);
+    else
+        standard_ExecutorEnd(queryDesc);
+}
+
+/* The statement of a possibly multi-statement source string a plan is for */
+static const char *pgqs_statement_text(const char *source, PlannedStmt *pstmt, int *len)
+{
+    *len = strlen(source);
+
+    if (pstmt->stmt_location >= 0 && pstmt->stmt_location < *len) {
+        source += pstmt->stmt_location;
+        *len = pstmt->stmt_len > 0 ? Min(pstmt->stmt_len, *len - pstmt->stmt_location)
+                                   : *len - pstmt->stmt_location;
+    }
+
+    return source;
+}
+
+/*
+ * A parameter value through its type's output function, or NULL if the
+ * output function fails.  The error is discarded: a value that cannot be
+ * printed only makes the statement not replayable.
+ */
+static char *pgqs_param_text(Oid typid, Datum value)
+{
+    MemoryContext oldcontext = CurrentMemoryContext;
+    char *volatile str = NULL;
+
+    PG_TRY();
+    {
+        Oid typoutput;
+        bool typisvarlena;
+
+        getTypeOutputInfo(typid, &typoutput, &typisvarlena);
+        str = OidOutputFunctionCall(typoutput, value);
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(oldcontext);
+        FlushErrorState();
+        str = NULL;
+    }
+    PG_END_TRY();
+
+    return str;
+}
+
+/*
+ * Encode bound parameters as text into a capture record.  Parameters that
+ * do not fit, have no type, have a type that is not built in, or whose
+ * output function fails mark the record as not replayable.  The texts are
+ * built in a short-lived context.
+ */
+static void pgqs_capture_params(pgqsCaptureRecord *record, ParamListInfo params)
+{
+    MemoryContext param_context;
+    MemoryContext oldcontext;
+    char *p = record->params;
+    char *end = record->params + CAPTURE_PARAMS_LENGTH;
+    int i;
+
+    param_context = AllocSetContextCreate(CurrentMemoryContext,
+                                          "pg_query_stats capture params",
+                                          ALLOCSET_SMALL_SIZES);
+    oldcontext = MemoryContextSwitchTo(param_context);
+
+    for (i = 0; i < params->numParams; i++) {
+        ParamExternData workspace;
+        ParamExternData *prm;
+        char *str = NULL;
+        size_t str_len = 0;
+        uint32 typid;
+        uint16 len;
+
+        if (params->paramFetch)
+            prm = params->paramFetch(params, i + 1, false, &workspace);
+        else
+            prm = &params->params[i];
+
+        if (!prm->isnull) {
+            if (!OidIsValid(prm->ptype) || prm->ptype >= FirstGenbkiObjectId ||
+                (str = pgqs_param_text(prm->ptype, prm->value)) == NULL) {
+                record->truncated = true;
+                break;
+            }
+            str_len = strlen(str);
+        }
+
+        if (str_len > PG_UINT16_MAX ||
+            p + 1 + sizeof(uint32) + sizeof(uint16) + str_len > end) {
+            record->truncated = true;
+            break;
+        }
+
+        typid = prm->ptype;
+        len = (uint16) str_len;
+        *p++ = prm->isnull;
+        memcpy(p, &typid, sizeof(typid));
+        p += sizeof(typid);
+        memcpy(p, &len, sizeof(len));
+        p += sizeof(len);
+        if (len > 0)
+            memcpy(p, str, len);
+        p += len;
+
+        record->nparams++;
+        record->params_len = p - record->params;
+    }
+
+    MemoryContextSwitchTo(oldcontext);
+    MemoryContextDelete(param_context);
+}
+
+/*
+ * Queue a finished top-level statement for the capture writer.  The record
+ * is built in backend memory first: once a cell is claimed, the consumer
+ * waits for it, so nothing between the claim and the publish may fail.
+ */
+static void pgqs_capture_statement(TimestampTz start_time, double duration, uint64 queryid,
+                                   const char *text, int text_len, ParamListInfo params)
+{
+    static pgqsCaptureRecord record;
+    pgqsCaptureCell *cell;
+    uint64 pos;
+
+    if (!capture_queue || IsParallelWorker())
+        return;
+
+    record.start_time = start_time;
+    record.pid = MyProcPid;
+    record.session_start = MyStartTimestamp;
+    record.dbid = MyDatabaseId;
+    record.queryid = queryid;
+    record.duration = duration;
+    record.truncated = text_len > MAX_QUERY_TEXT_LENGTH;
+    record.text_len = Min(text_len, MAX_QUERY_TEXT_LENGTH);
+    memcpy(record.text, text, record.text_len);
+    record.nparams = 0;
+    record.params_len = 0;
+    if (params && params->numParams > 0)
+        pgqs_capture_params(&record, params);
+
+    pos = pg_atomic_read_u64(&capture_queue->enqueue_pos);
+    for (;;) {
+        int64 diff;
+
+        cell = &capture_queue->cells[pos & (CAPTURE_QUEUE_SIZE - 1)];
+        diff = (int64) pg_atomic_read_u64(&cell->sequence) - (int64) pos;
+
+        if (diff == 0) {
+            if (pg_atomic_compare_exchange_u64(&capture_queue->enqueue_pos, &pos, pos + 1))
+                break;
+        } else if (diff < 0) {
+            pg_atomic_fetch_add_u64(&capture_queue->dropped, 1);
+            return;
+        } else {
+            pos = pg_atomic_read_u64(&capture_queue->enqueue_pos);
+        }
+    }
+
+    memcpy(&cell->record, &record, offsetof(pgqsCaptureRecord, text));
+    memcpy(cell->record.text, record.text, record.text_len);
+    memcpy(cell->record.params, record.params, record.params_len);
+
+    pg_write_barrier();
+    pg_atomic_write_u64(&cell->sequence, pos + 1);
+    pg_atomic_fetch_add_u64(&capture_queue->captured, 1);
+
+    /* Between its timed rounds, wake the writer every half queue */
+    if ((pos & (CAPTURE_QUEUE_SIZE / 2 - 1)) == 0 && capture_queue->writer_latch)
+        SetLatch(capture_queue->writer_latch);
+}
+
+/* ProcessUtility: count top-level utility statements by command tag */
+static void pgqs_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+                                bool readOnlyTree, ProcessUtilityContext context,
+                                ParamListInfo params, QueryEnvironment *queryEnv,
+                                DestReceiver *dest, QueryCompletion *qc)
+{
+    bool count = pgqs_enabled && context == PROCESS_UTILITY_TOPLEVEL &&
+                 utility_depth == 0 && exec_nested_level == 0;
+    TimestampTz start = count ? GetCurrentTimestamp() : 0;
+    CommandTag tag = count ? CreateCommandTag(pstmt->utilityStmt) : CMDTAG_UNKNOWN;
+    /* Time up to COMMIT or ROLLBACK is the transaction's idle time */
+    bool gaps = count && !IsA(pstmt->utilityStmt, TransactionStmt);
+    CachedPlanSource *save_plansource = execute_plansource;
+
+    if (gaps)
+        pgqs_note_gap(start);
+
+    if (IsA(pstmt->utilityStmt, ExecuteStmt)) {
+        PreparedStatement *prepared =
+            FetchPreparedStatement(((ExecuteStmt *) pstmt->utilityStmt)->name, false);
+
+        execute_plansource = prepared ? prepared->plansource : NULL;
+    }
+
+    utility_depth++;
+    PG_TRY();
+    {
+        if (prev_ProcessUtility)
+            prev_ProcessUtility(pstmt, queryString, readOnlyTree, context,
+                                params, queryEnv, dest, qc);
+        else
+            standard_ProcessUtility(pstmt, queryString, readOnlyTree, context,
+                                    params, queryEnv, dest, qc);
+    }
+    PG_FINALLY();
+    {
+        utility_depth--;
+        execute_plansource = save_plansource;
+    }
+    PG_END_TRY();
+
+    if (count) {
+        double duration_ms = (double) (GetCurrentTimestamp() - start) / 1000.0;
+
+        pgqs_count(&workload_state->cmdtags[tag], duration_ms);
+        pgqs_count(pgqs_database_counter(), duration_ms);
+        if (gaps)
+            current_xact.last_end_time = GetCurrentTimestamp();
+
+        if (pgqs_capture && capture_queue) {
+            int len;
+            const char *text = pgqs_statement_text(queryString, pstmt, &len);
+            char *prefix = pnstrdup(text, Min(len, MAX_QUERY_TEXT_LENGTH - 1));
+
+            pgqs_capture_statement(start, duration_ms, pgqs_fingerprint(prefix),
+                                   text, len, NULL);
+            pfree(prefix);
+        }
+    }
+}
+
+/* pg_query_stats */
+Datum pg_query_stats(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(6);
+        TupleDescInitEntry(tupdesc, 1, "query_text", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "total_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "min_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "max_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "queryid", INT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(shared_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < shared_state->num_entries) {
+        Datum values[6];
+        bool nulls[6] = {false};
+        HeapTuple tuple;
+        QueryStatEntry *entry = &shared_state->entries[funcctx->call_cntr];
+
+        values[0] = CStringGetTextDatum(pgqs_fetch_text(entry->text_id));
+        values[1] = Int64GetDatum(entry->calls);
+        values[2] = Float8GetDatum(entry->total_time);
+        values[3] = Float8GetDatum(entry->min_time);
+        values[4] = Float8GetDatum(entry->max_time);
+        values[5] = Int64GetDatum((int64) entry->queryid);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(shared_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(shared_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_plan_nodes */
+Datum pg_query_stats_plan_nodes(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(9);
+        TupleDescInitEntry(tupdesc, 1, "dbid", OIDOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "relid", OIDOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "node_type", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "loops", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "total_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 7, "rows", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 8, "sum_qerror", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 9, "max_qerror", FLOAT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(plan_node_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < plan_node_state->num_entries) {
+        Datum values[9];
+        bool nulls[9] = {false};
+        HeapTuple tuple;
+        PlanNodeStatEntry *entry = &plan_node_state->entries[funcctx->call_cntr];
+
+        values[0] = ObjectIdGetDatum(entry->dbid);
+        values[1] = ObjectIdGetDatum(entry->relid);
+        values[2] = CStringGetTextDatum(pgqs_node_type_name(entry->node_type));
+        values[3] = Int64GetDatum(entry->calls);
+        values[4] = Int64GetDatum(entry->loops);
+        values[5] = Float8GetDatum(entry->total_time);
+        values[6] = Float8GetDatum(entry->rows);
+        values[7] = Float8GetDatum(entry->sum_qerror);
+        values[8] = Float8GetDatum(entry->max_qerror);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(plan_node_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(plan_node_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_estimates */
+Datum pg_query_stats_estimates(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(6);
+        TupleDescInitEntry(tupdesc, 1, "queryid", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "query_text", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "sampled_calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "sum_qerror", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "max_qerror", FLOAT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(shared_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < shared_state->num_entries) {
+        Datum values[6];
+        bool nulls[6] = {false};
+        HeapTuple tuple;
+        QueryStatEntry *entry = &shared_state->entries[funcctx->call_cntr];
+
+        values[0] = Int64GetDatum((int64) entry->queryid);
+        values[1] = CStringGetTextDatum(pgqs_fetch_text(entry->text_id));
+        values[2] = Int64GetDatum(entry->calls);
+        values[3] = Int64GetDatum(entry->sampled_calls);
+        values[4] = Float8GetDatum(entry->sum_qerror);
+        values[5] = Float8GetDatum(entry->max_qerror);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(shared_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(shared_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_spills */
+Datum pg_query_stats_spills(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(9);
+        TupleDescInitEntry(tupdesc, 1, "queryid", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "query_text", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "spill_calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "temp_blks_read", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "temp_blks_written", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 7, "sampled_calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 8, "peak_mem_kb", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 9, "suggested_work_mem_kb", INT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(shared_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < shared_state->num_entries) {
+        Datum values[9];
+        bool nulls[9] = {false};
+        HeapTuple tuple;
+        QueryStatEntry *entry = &shared_state->entries[funcctx->call_cntr];
+
+        values[0] = Int64GetDatum((int64) entry->queryid);
+        values[1] = CStringGetTextDatum(pgqs_fetch_text(entry->text_id));
+        values[2] = Int64GetDatum(entry->calls);
+        values[3] = Int64GetDatum(entry->spill_calls);
+        values[4] = Int64GetDatum(entry->temp_blks_read);
+        values[5] = Int64GetDatum(entry->temp_blks_written);
+        values[6] = Int64GetDatum(entry->sampled_calls);
+        values[7] = Int64GetDatum(entry->peak_mem_kb);
+        values[8] = Int64GetDatum(entry->suggested_work_mem_kb);
+        nulls[8] = entry->suggested_work_mem_kb == 0;
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(shared_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(shared_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_seq_scans */
+Datum pg_query_stats_seq_scans(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(7);
+        TupleDescInitEntry(tupdesc, 1, "dbid", OIDOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "relid", OIDOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "attnums", INT2ARRAYOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "rows_returned", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "rows_removed", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 7, "total_time", FLOAT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(seq_scan_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < seq_scan_state->num_entries) {
+        Datum values[7];
+        bool nulls[7] = {false};
+        Datum attnums[MAX_FILTER_COLUMNS];
+        HeapTuple tuple;
+        SeqScanStatEntry *entry = &seq_scan_state->entries[funcctx->call_cntr];
+        int i;
+
+        for (i = 0; i < entry->nattnums; i++)
+            attnums[i] = Int16GetDatum(entry->attnums[i]);
+
+        values[0] = ObjectIdGetDatum(entry->dbid);
+        values[1] = ObjectIdGetDatum(entry->relid);
+        values[2] = PointerGetDatum(construct_array(attnums, entry->nattnums, INT2OID,
+                                                    sizeof(int16), true, TYPALIGN_SHORT));
+        values[3] = Int64GetDatum(entry->calls);
+        values[4] = Float8GetDatum(entry->rows_returned);
+        values[5] = Float8GetDatum(entry->rows_removed);
+        values[6] = Float8GetDatum(entry->total_time);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(seq_scan_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(seq_scan_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_parallel */
+Datum pg_query_stats_parallel(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(10);
+        TupleDescInitEntry(tupdesc, 1, "queryid", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "query_text", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "total_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "parallel_calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "workers_planned", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 7, "workers_launched", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 8, "leader_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 9, "worker_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 10, "gather_time", FLOAT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(shared_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < shared_state->num_entries) {
+        Datum values[10];
+        bool nulls[10] = {false};
+        HeapTuple tuple;
+        QueryStatEntry *entry = &shared_state->entries[funcctx->call_cntr];
+
+        values[0] = Int64GetDatum((int64) entry->queryid);
+        values[1] = CStringGetTextDatum(pgqs_fetch_text(entry->text_id));
+        values[2] = Int64GetDatum(entry->calls);
+        values[3] = Float8GetDatum(entry->total_time);
+        values[4] = Int64GetDatum(entry->parallel_calls);
+        values[5] = Int64GetDatum(entry->workers_planned);
+        values[6] = Int64GetDatum(entry->workers_launched);
+        values[7] = Float8GetDatum(entry->leader_time);
+        values[8] = Float8GetDatum(entry->worker_time);
+        values[9] = Float8GetDatum(entry->gather_time);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(shared_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(shared_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_jit */
+Datum pg_query_stats_jit(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(11);
+        TupleDescInitEntry(tupdesc, 1, "queryid", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "query_text", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "jit_calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "jit_exec_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "jit_functions", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 7, "jit_generation_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 8, "jit_deform_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 9, "jit_inlining_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 10, "jit_optimization_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 11, "jit_emission_time", FLOAT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(shared_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < shared_state->num_entries) {
+        Datum values[11];
+        bool nulls[11] = {false};
+        HeapTuple tuple;
+        QueryStatEntry *entry = &shared_state->entries[funcctx->call_cntr];
+
+        values[0] = Int64GetDatum((int64) entry->queryid);
+        values[1] = CStringGetTextDatum(pgqs_fetch_text(entry->text_id));
+        values[2] = Int64GetDatum(entry->calls);
+        values[3] = Int64GetDatum(entry->jit_calls);
+        values[4] = Float8GetDatum(entry->jit_exec_time);
+        values[5] = Int64GetDatum(entry->jit_functions);
+        values[6] = Float8GetDatum(entry->jit_generation_time);
+        values[7] = Float8GetDatum(entry->jit_deform_time);
+        values[8] = Float8GetDatum(entry->jit_inlining_time);
+        values[9] = Float8GetDatum(entry->jit_optimization_time);
+        values[10] = Float8GetDatum(entry->jit_emission_time);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(shared_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(shared_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_plan_cache */
+Datum pg_query_stats_plan_cache(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(7);
+        TupleDescInitEntry(tupdesc, 1, "queryid", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "query_text", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "generic_calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "generic_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "custom_calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 7, "custom_time", FLOAT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(shared_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < shared_state->num_entries) {
+        Datum values[7];
+        bool nulls[7] = {false};
+        HeapTuple tuple;
+        QueryStatEntry *entry = &shared_state->entries[funcctx->call_cntr];
+
+        values[0] = Int64GetDatum((int64) entry->queryid);
+        values[1] = CStringGetTextDatum(pgqs_fetch_text(entry->text_id));
+        values[2] = Int64GetDatum(entry->calls);
+        values[3] = Int64GetDatum(entry->generic_calls);
+        values[4] = Float8GetDatum(entry->generic_time);
+        values[5] = Int64GetDatum(entry->custom_calls);
+        values[6] = Float8GetDatum(entry->custom_time);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(shared_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(shared_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_waits */
+Datum pg_query_stats_waits(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(5);
+        TupleDescInitEntry(tupdesc, 1, "queryid", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "wait_event_type", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "wait_event", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "samples", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "time", FLOAT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(wait_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < wait_state->num_entries) {
+        Datum values[5];
+        bool nulls[5] = {false};
+        HeapTuple tuple;
+        WaitStatEntry *entry = &wait_state->entries[funcctx->call_cntr];
+        const char *event_type = pgstat_get_wait_event_type(entry->wait_event_info);
+        const char *event = pgstat_get_wait_event(entry->wait_event_info);
+
+        values[0] = Int64GetDatum((int64) entry->queryid);
+        if (event_type)
+            values[1] = CStringGetTextDatum(event_type);
+        else
+            nulls[1] = true;
+        if (event)
+            values[2] = CStringGetTextDatum(event);
+        else
+            nulls[2] = true;
+        values[3] = Int64GetDatum(entry->samples);
+        values[4] = Float8GetDatum(entry->time);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(wait_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(wait_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_active */
+Datum pg_query_stats_active(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+    int *next_slot;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(5);
+        TupleDescInitEntry(tupdesc, 1, "pid", INT4OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "dbid", OIDOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "queryid", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "nesting_level", INT4OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "start_time", TIMESTAMPTZOID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        funcctx->user_fctx = palloc0(sizeof(int));
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    next_slot = (int *) funcctx->user_fctx;
+
+    while (*next_slot < num_backend_slots) {
+        int i = (*next_slot)++;
+        pgqsSlotCopy copy;
+        int pid = ProcGlobal->allProcs[i].pid;
+        Datum values[5];
+        bool nulls[5] = {false};
+        HeapTuple tuple;
+
+        pgqs_read_slot(&backend_slots[i], &copy);
+
+        if (copy.queryid == 0 || pid == 0)
+            continue;
+
+        values[0] = Int32GetDatum(pid);
+        values[1] = ObjectIdGetDatum(copy.dbid);
+        values[2] = Int64GetDatum((int64) copy.queryid);
+        values[3] = Int32GetDatum(copy.nesting_level);
+        values[4] = TimestampTzGetDatum(copy.start_time);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_concurrency */
+Datum pg_query_stats_concurrency(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(9);
+        TupleDescInitEntry(tupdesc, 1, "queryid", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "query_text", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "inflight", INT4OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "peak_concurrency", INT4OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "concurrency_starts", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 7, "concurrency_sum", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 8, "hist_calls", INT8ARRAYOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 9, "hist_time", FLOAT8ARRAYOID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(shared_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < shared_state->num_entries) {
+        Datum values[9];
+        bool nulls[9] = {false};
+        Datum hist_calls[CONCURRENCY_BUCKETS];
+        Datum hist_time[CONCURRENCY_BUCKETS];
+        HeapTuple tuple;
+        QueryStatEntry *entry = &shared_state->entries[funcctx->call_cntr];
+        int i;
+
+        for (i = 0; i < CONCURRENCY_BUCKETS; i++) {
+            hist_calls[i] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->concurrency_hist[i]));
+            hist_time[i] = Float8GetDatum(entry->concurrency_hist_time[i]);
+        }
+
+        values[0] = Int64GetDatum((int64) entry->queryid);
+        values[1] = CStringGetTextDatum(pgqs_fetch_text(entry->text_id));
+        values[2] = Int64GetDatum(entry->calls);
+        values[3] = Int32GetDatum((int32) pg_atomic_read_u32(&entry->inflight));
+        values[4] = Int32GetDatum((int32) pg_atomic_read_u32(&entry->peak_concurrency));
+        values[5] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->concurrency_starts));
+        values[6] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->concurrency_sum));
+        values[7] = PointerGetDatum(construct_array(hist_calls, CONCURRENCY_BUCKETS, INT8OID,
+                                                    sizeof(int64), FLOAT8PASSBYVAL, TYPALIGN_DOUBLE));
+        values[8] = PointerGetDatum(construct_array(hist_time, CONCURRENCY_BUCKETS, FLOAT8OID,
+                                                    sizeof(float8), FLOAT8PASSBYVAL, TYPALIGN_DOUBLE));
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(shared_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(shared_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_client_send */
+Datum pg_query_stats_client_send(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(8);
+        TupleDescInitEntry(tupdesc, 1, "queryid", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "query_text", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "send_calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "send_exec_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "send_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 7, "rows_sent", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 8, "bytes_sent", INT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(shared_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < shared_state->num_entries) {
+        Datum values[8];
+        bool nulls[8] = {false};
+        HeapTuple tuple;
+        QueryStatEntry *entry = &shared_state->entries[funcctx->call_cntr];
+
+        values[0] = Int64GetDatum((int64) entry->queryid);
+        values[1] = CStringGetTextDatum(pgqs_fetch_text(entry->text_id));
+        values[2] = Int64GetDatum(entry->calls);
+        values[3] = Int64GetDatum(entry->send_calls);
+        values[4] = Float8GetDatum(entry->send_exec_time);
+        values[5] = Float8GetDatum(entry->send_time);
+        values[6] = Int64GetDatum(entry->rows_sent);
+        values[7] = Int64GetDatum(entry->bytes_sent);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(shared_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(shared_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_xacts */
+Datum pg_query_stats_xacts(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(15);
+        TupleDescInitEntry(tupdesc, 1, "dbid", OIDOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "xact_fingerprint", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "nstatements", INT4OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "statements", INT8ARRAYOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "commits", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 7, "aborts", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 8, "total_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 9, "min_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 10, "max_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 11, "commit_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 12, "serialization_failures", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 13, "deadlocks", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 14, "retries", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 15, "retry_wasted_time", FLOAT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(xact_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < xact_state->num_entries) {
+        Datum values[15];
+        bool nulls[15] = {false};
+        Datum statements[XACT_SHAPE_STATEMENTS];
+        HeapTuple tuple;
+        XactStatEntry *entry = &xact_state->entries[funcctx->call_cntr];
+        int nshown = Min(entry->nstatements, XACT_SHAPE_STATEMENTS);
+        int i;
+
+        for (i = 0; i < nshown; i++)
+            statements[i] = Int64GetDatum((int64) entry->statements[i]);
+
+        values[0] = ObjectIdGetDatum(entry->dbid);
+        values[1] = Int64GetDatum((int64) entry->fingerprint);
+        values[2] = Int32GetDatum(entry->nstatements);
+        values[3] = PointerGetDatum(construct_array(statements, nshown, INT8OID,
+                                                    sizeof(int64), FLOAT8PASSBYVAL, TYPALIGN_DOUBLE));
+        values[4] = Int64GetDatum(entry->calls);
+        values[5] = Int64GetDatum(entry->commits);
+        values[6] = Int64GetDatum(entry->aborts);
+        values[7] = Float8GetDatum(entry->total_time);
+        values[8] = Float8GetDatum(entry->min_time);
+        values[9] = Float8GetDatum(entry->max_time);
+        values[10] = Float8GetDatum(entry->commit_time);
+        values[11] = Int64GetDatum(entry->serialization_failures);
+        values[12] = Int64GetDatum(entry->deadlocks);
+        values[13] = Int64GetDatum(entry->retries);
+        values[14] = Float8GetDatum(entry->retry_wasted_time);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(xact_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(xact_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_repeats */
+Datum pg_query_stats_repeats(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(8);
+        TupleDescInitEntry(tupdesc, 1, "queryid", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "query_text", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "total_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "xacts", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "xact_calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 7, "max_xact_calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 8, "xact_statements", INT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(shared_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < shared_state->num_entries) {
+        Datum values[8];
+        bool nulls[8] = {false};
+        HeapTuple tuple;
+        QueryStatEntry *entry = &shared_state->entries[funcctx->call_cntr];
+
+        values[0] = Int64GetDatum((int64) entry->queryid);
+        values[1] = CStringGetTextDatum(pgqs_fetch_text(entry->text_id));
+        values[2] = Int64GetDatum(entry->calls);
+        values[3] = Float8GetDatum(entry->total_time);
+        values[4] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->xacts));
+        values[5] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->xact_calls));
+        values[6] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->max_xact_calls));
+        values[7] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->xact_statements));
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(shared_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(shared_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_xact_gaps */
+Datum pg_query_stats_xact_gaps(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(9);
+        TupleDescInitEntry(tupdesc, 1, "dbid", OIDOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "xact_fingerprint", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "application_name", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "xacts", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "xact_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "gaps", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 7, "gap_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 8, "max_gap", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 9, "idle_time", FLOAT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(xact_gap_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < xact_gap_state->num_entries) {
+        Datum values[9];
+        bool nulls[9] = {false};
+        HeapTuple tuple;
+        XactGapStatEntry *entry = &xact_gap_state->entries[funcctx->call_cntr];
+
+        values[0] = ObjectIdGetDatum(entry->dbid);
+        values[1] = Int64GetDatum((int64) entry->fingerprint);
+        values[2] = CStringGetTextDatum(entry->application_name);
+        values[3] = Int64GetDatum(entry->xacts);
+        values[4] = Float8GetDatum(entry->xact_time);
+        values[5] = Int64GetDatum(entry->gaps);
+        values[6] = Float8GetDatum(entry->gap_time);
+        values[7] = Float8GetDatum(entry->max_gap);
+        values[8] = Float8GetDatum(entry->idle_time);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(xact_gap_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(xact_gap_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_sessions */
+Datum pg_query_stats_sessions(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+    int *next_slot;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(10);
+        TupleDescInitEntry(tupdesc, 1, "pid", INT4OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "application_name", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "client_addr", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "session_start", TIMESTAMPTZOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "statements", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "total_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 7, "rows", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 8, "shared_blks_hit", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 9, "shared_blks_read", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 10, "shared_blks_written", INT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        funcctx->user_fctx = palloc0(sizeof(int));
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    next_slot = (int *) funcctx->user_fctx;
+
+    while (*next_slot < num_backend_slots) {
+        int i = (*next_slot)++;
+        pgqsSlotCopy copy;
+        Datum values[10];
+        bool nulls[10] = {false};
+        HeapTuple tuple;
+
+        pgqs_read_slot(&backend_slots[i], &copy);
+
+        if (copy.session.pid == 0 || ProcGlobal->allProcs[i].pid != copy.session.pid)
+            continue;
+
+        values[0] = Int32GetDatum(copy.session.pid);
+        values[1] = CStringGetTextDatum(copy.session.application_name);
+        values[2] = CStringGetTextDatum(copy.session.client_addr);
+        values[3] = TimestampTzGetDatum(copy.session.session_start);
+        values[4] = Int64GetDatum(copy.session.statements);
+        values[5] = Float8GetDatum(copy.session.total_time);
+        values[6] = Int64GetDatum(copy.session.rows);
+        values[7] = Int64GetDatum(copy.session.shared_blks_hit);
+        values[8] = Int64GetDatum(copy.session.shared_blks_read);
+        values[9] = Int64GetDatum(copy.session.shared_blks_written);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_applications */
+Datum pg_query_stats_applications(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(10);
+        TupleDescInitEntry(tupdesc, 1, "application_name", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "client_addr", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "sessions", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "session_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "statements", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "total_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 7, "rows", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 8, "shared_blks_hit", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 9, "shared_blks_read", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 10, "shared_blks_written", INT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(application_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < application_state->num_entries) {
+        Datum values[10];
+        bool nulls[10] = {false};
+        HeapTuple tuple;
+        ApplicationStatEntry *entry = &application_state->entries[funcctx->call_cntr];
+
+        values[0] = CStringGetTextDatum(entry->application_name);
+        values[1] = CStringGetTextDatum(entry->client_addr);
+        values[2] = Int64GetDatum(entry->sessions);
+        values[3] = Float8GetDatum(entry->session_time);
+        values[4] = Int64GetDatum(entry->statements);
+        values[5] = Float8GetDatum(entry->total_time);
+        values[6] = Int64GetDatum(entry->rows);
+        values[7] = Int64GetDatum(entry->shared_blks_hit);
+        values[8] = Int64GetDatum(entry->shared_blks_read);
+        values[9] = Int64GetDatum(entry->shared_blks_written);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(application_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(application_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_failures */
+Datum pg_query_stats_failures(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(6);
+        TupleDescInitEntry(tupdesc, 1, "queryid", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "query_text", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "sqlstate", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "failures", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "total_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "max_time", FLOAT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(failure_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < failure_state->num_entries) {
+        Datum values[6];
+        bool nulls[6] = {false};
+        HeapTuple tuple;
+        FailureStatEntry *entry = &failure_state->entries[funcctx->call_cntr];
+
+        values[0] = Int64GetDatum((int64) entry->queryid);
+        values[1] = CStringGetTextDatum(pgqs_fetch_text(entry->text_id));
+        if (entry->sqlerrcode != 0)
+            values[2] = CStringGetTextDatum(unpack_sql_state(entry->sqlerrcode));
+        else
+            nulls[2] = true;
+        values[3] = Int64GetDatum(entry->failures);
+        values[4] = Float8GetDatum(entry->total_time);
+        values[5] = Float8GetDatum(entry->max_time);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(failure_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(failure_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_relations */
+Datum pg_query_stats_relations(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(8);
+        TupleDescInitEntry(tupdesc, 1, "dbid", OIDOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "relid", OIDOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "total_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "shared_blks_hit", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "shared_blks_read", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 7, "shared_blks_dirtied", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 8, "shared_blks_written", FLOAT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(relation_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < relation_state->num_entries) {
+        Datum values[8];
+        bool nulls[8] = {false};
+        HeapTuple tuple;
+        RelationStatEntry *entry = &relation_state->entries[funcctx->call_cntr];
+
+        values[0] = ObjectIdGetDatum(entry->dbid);
+        values[1] = ObjectIdGetDatum(entry->relid);
+        values[2] = Int64GetDatum(entry->calls);
+        values[3] = Float8GetDatum(entry->total_time);
+        values[4] = Float8GetDatum(entry->shared_blks_hit);
+        values[5] = Float8GetDatum(entry->shared_blks_read);
+        values[6] = Float8GetDatum(entry->shared_blks_dirtied);
+        values[7] = Float8GetDatum(entry->shared_blks_written);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(relation_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(relation_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* pg_query_stats_indexes */
+Datum pg_query_stats_indexes(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(5);
+        TupleDescInitEntry(tupdesc, 1, "dbid", OIDOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "indexid", OIDOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "queryid", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "total_time", FLOAT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    LWLockAcquire(index_state->lock, LW_SHARED);
+
+    if (funcctx->call_cntr < index_state->num_entries) {
+        Datum values[5];
+        bool nulls[5] = {false};
+        HeapTuple tuple;
+        IndexStatEntry *entry = &index_state->entries[funcctx->call_cntr];
+
+        values[0] = ObjectIdGetDatum(entry->dbid);
+        values[1] = ObjectIdGetDatum(entry->indexid);
+        values[2] = Int64GetDatum((int64) entry->queryid);
+        values[3] = Int64GetDatum(entry->calls);
+        values[4] = Float8GetDatum(entry->total_time);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        LWLockRelease(index_state->lock);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    LWLockRelease(index_state->lock);
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* Name of a command type */
+static const char *pgqs_cmdtype_name(CmdType cmdtype)
+{
+    switch (cmdtype)
+    {
+        case CMD_SELECT: return "SELECT";
+        case CMD_INSERT: return "INSERT";
+        case CMD_UPDATE: return "UPDATE";
+        case CMD_DELETE: return "DELETE";
+        case CMD_MERGE: return "MERGE";
+        case CMD_UTILITY: return "UTILITY";
+        case CMD_NOTHING: return "NOTHING";
+        default: return "UNKNOWN";
+    }
+}
+
+/*
+ * pg_query_stats_workload: one row per non-empty counter, command types
+ * first, then command tags, then databases.
+ */
+Datum pg_query_stats_workload(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+    int *next;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(5);
+        TupleDescInitEntry(tupdesc, 1, "kind", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "name", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "dbid", OIDOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "total_time", FLOAT8OID, -1, 0);
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        funcctx->user_fctx = palloc0(sizeof(int));
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    next = (int *) funcctx->user_fctx;
+
+    while (*next < PGQS_NUM_CMDTYPES + COMMAND_TAG_NEXTTAG + MAX_DATABASE_COUNTERS + 1) {
+        int i = (*next)++;
+        pgqsCounter *counter;
+        Datum values[5];
+        bool nulls[5] = {false};
+        HeapTuple tuple;
+        uint64 calls;
+
+        if (i < PGQS_NUM_CMDTYPES) {
+            counter = &workload_state->cmdtypes[i];
+            values[0] = CStringGetTextDatum("command_type");
+            values[1] = CStringGetTextDatum(pgqs_cmdtype_name((CmdType) i));
+            nulls[2] = true;
+        } else if ((i -= PGQS_NUM_CMDTYPES) < COMMAND_TAG_NEXTTAG) {
+            counter = &workload_state->cmdtags[i];
+            values[0] = CStringGetTextDatum("command_tag");
+            values[1] = CStringGetTextDatum(GetCommandTagName((CommandTag) i));
+            nulls[2] = true;
+        } else if ((i -= COMMAND_TAG_NEXTTAG) < MAX_DATABASE_COUNTERS) {
+            counter = &workload_state->databases[i];
+            values[0] = CStringGetTextDatum("database");
+            nulls[1] = true;
+            values[2] = ObjectIdGetDatum(pg_atomic_read_u32(&workload_state->dbids[i]));
+        } else {
+            counter = &workload_state->other_databases;
+            values[0] = CStringGetTextDatum("database");
+            values[1] = CStringGetTextDatum("(other)");
+            nulls[2] = true;
+        }
+
+        calls = pg_atomic_read_u64(&counter->calls);
+        if (calls == 0)
+            continue;
+
+        values[3] = Int64GetDatum(calls);
+        values[4] = Float8GetDatum((double) pg_atomic_read_u64(&counter->time_us) / 1000.0);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * pg_query_stats_export: the statement table as one bytea, for merging
+ * across servers.  The header (magic, version, flags, entry count, payload
+ * length before compression, export time) is followed by the payload, one
+ * record per statement in network byte order: queryid, calls, total, min
+ * and max time, temp blocks read and written, the concurrency histogram
+ * (starts and time per bucket) and the text.  The other counters are
+ * not exported.
+ */
+Datum pg_query_stats_export(PG_FUNCTION_ARGS) {
+    StringInfoData payload;
+    StringInfoData result;
+    char *compressed;
+    int32 compressed_len;
+    int nentries;
+    int i;
+    int j;
+
+    initStringInfo(&payload);
+
+    LWLockAcquire(shared_state->lock, LW_SHARED);
+
+    nentries = shared_state->num_entries;
+    for (i = 0; i < nentries; i++) {
+        QueryStatEntry *entry = &shared_state->entries[i];
+        char *text = pgqs_fetch_text(entry->text_id);
+        int len = strlen(text);
+
+        pq_sendint64(&payload, (int64) entry->queryid);
+        pq_sendint64(&payload, (int64) entry->calls);
+        pq_sendfloat8(&payload, entry->total_time);
+        pq_sendfloat8(&payload, entry->min_time);
+        pq_sendfloat8(&payload, entry->max_time);
+        pq_sendint64(&payload, entry->temp_blks_read);
+        pq_sendint64(&payload, entry->temp_blks_written);
+        for (j = 0; j < CONCURRENCY_BUCKETS; j++) {
+            pq_sendint64(&payload, (int64) pg_atomic_read_u64(&entry->concurrency_hist[j]));
+            pq_sendfloat8(&payload, entry->concurrency_hist_time[j]);
+        }
+        pq_sendint16(&payload, (uint16) len);
+        pq_sendbytes(&payload, text, len);
+        pfree(text);
+    }
+
+    LWLockRelease(shared_state->lock);
+
+    compressed = palloc(PGLZ_MAX_OUTPUT(payload.len));
+    compressed_len = pglz_compress(payload.data, payload.len, compressed,
+                                   PGLZ_strategy_always);
+
+    pq_begintypsend(&result);
+    pq_sendint32(&result, PGQS_EXPORT_MAGIC);
+    pq_sendint32(&result, PGQS_EXPORT_VERSION);
+    pq_sendint32(&result, compressed_len >= 0 ? PGQS_EXPORT_PGLZ : 0);
+    pq_sendint32(&result, nentries);
+    pq_sendint64(&result, GetCurrentTimestamp());
+    pq_sendint32(&result, payload.len);
+    if (compressed_len >= 0)
+        pq_sendbytes(&result, compressed, compressed_len);
+    else
+        pq_sendbytes(&result, payload.data, payload.len);
+
+    pfree(compressed);
+    pfree(payload.data);
+
+    PG_RETURN_BYTEA_P(pq_endtypsend(&result));
+}
+
+/* Statement decoded from an export */
+typedef struct {
+    uint64 queryid;
+    uint64 calls;
+    double total_time;
+    double min_time;
+    double max_time;
+    int64 temp_blks_read;
+    int64 temp_blks_written;
+    uint64 concurrency_hist[CONCURRENCY_BUCKETS];
+    double concurrency_hist_time[CONCURRENCY_BUCKETS];
+    int sources;                /* exports the statement appeared in */
+    char *query_text;
+} pgqsMergeRow;
+
+/* Append the statements of one export to rows */
+static int pgqs_decode_export(bytea *export, pgqsMergeRow **rows, int nrows, int *maxrows)
+{
+    StringInfoData buf;
+    StringInfoData payload;
+    int32 flags;
+    int32 nentries;
+    int32 raw_len;
+    int i;
+    int j;
+
+    buf.data = VARDATA_ANY(export);
+    buf.len = VARSIZE_ANY_EXHDR(export);
+    buf.maxlen = buf.len;
+    buf.cursor = 0;
+
+    if (buf.len < PGQS_EXPORT_HEADER_SIZE ||
+        pq_getmsgint(&buf, 4) != PGQS_EXPORT_MAGIC)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("pg_query_stats: not a pg_query_stats export")));
+
+    if (pq_getmsgint(&buf, 4) != PGQS_EXPORT_VERSION)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("pg_query_stats: unsupported export version")));
+
+    flags = pq_getmsgint(&buf, 4);
+    nentries = pq_getmsgint(&buf, 4);
+    (void) pq_getmsgint64(&buf);    /* export time */
+    raw_len = pq_getmsgint(&buf, 4);
+
+    /* Every record takes at least its fixed part, so nentries is bounded */
+    if (nentries < 0 || raw_len < 0 || raw_len >= MaxAllocSize ||
+        nentries > raw_len / PGQS_EXPORT_MIN_RECORD_SIZE)
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_CORRUPTED),
+                 errmsg("pg_query_stats: corrupted export header")));
+
+    if (flags & PGQS_EXPORT_PGLZ) {
+        payload.data = palloc(raw_len + 1);
+        if (pglz_decompress(buf.data + buf.cursor, buf.len - buf.cursor,
+                            payload.data, raw_len, true) != raw_len)
+            ereport(ERROR,
+                    (errcode(ERRCODE_DATA_CORRUPTED),
+                     errmsg("pg_query_stats: corrupted export payload")));
+    } else {
+        if (buf.len - buf.cursor != raw_len)
+            ereport(ERROR,
+                    (errcode(ERRCODE_DATA_CORRUPTED),
+                     errmsg("pg_query_stats: corrupted export payload")));
+        payload.data = buf.data + buf.cursor;
+    }
+    payload.len = raw_len;
+    payload.maxlen = raw_len;
+    payload.cursor = 0;
+
+    if ((Size) nrows + nentries > (Size) *maxrows) {
+        Size newmax = Max((Size) *maxrows * 2, (Size) nrows + nentries);
+
+        if ((Size) nrows + nentries > INT_MAX ||
+            (Size) nrows + nentries > MaxAllocHugeSize / sizeof(pgqsMergeRow))
+            ereport(ERROR,
+                    (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                     errmsg("pg_query_stats: too many statements in exports")));
+
+        newmax = Min(newmax, Min((Size) INT_MAX, MaxAllocHugeSize / sizeof(pgqsMergeRow)));
+        *rows = repalloc_huge(*rows, newmax * sizeof(pgqsMergeRow));
+        *maxrows = (int) newmax;
+    }
+
+    for (i = 0; i < nentries; i++) {
+        pgqsMergeRow *row = &(*rows)[nrows++];
+        int len;
+
+        row->queryid = (uint64) pq_getmsgint64(&payload);
+        row->calls = (uint64) pq_getmsgint64(&payload);
+        row->total_time = pq_getmsgfloat8(&payload);
+        row->min_time = pq_getmsgfloat8(&payload);
+        row->max_time = pq_getmsgfloat8(&payload);
+        row->temp_blks_read = pq_getmsgint64(&payload);
+        row->temp_blks_written = pq_getmsgint64(&payload);
+        for (j = 0; j < CONCURRENCY_BUCKETS; j++) {
+            row->concurrency_hist[j] = (uint64) pq_getmsgint64(&payload);
+            row->concurrency_hist_time[j] = pq_getmsgfloat8(&payload);
+        }
+        len = pq_getmsgint(&payload, 2);
+        row->query_text = pnstrdup(pq_getmsgbytes(&payload, len), len);
+        row->sources = 1;
+    }
+
+    return nrows;
+}
+
+static int pgqs_merge_row_cmp(const void *a, const void *b)
+{
+    uint64 qa = ((const pgqsMergeRow *) a)->queryid;
+    uint64 qb = ((const pgqsMergeRow *) b)->queryid;
+
+    return (qa > qb) - (qa < qb);
+}
+
+/*
+ * pg_query_stats_merge: combine exports from several servers into one row
+ * per statement.  Rows of all exports are sorted by queryid and folded.
+ */
+Datum pg_query_stats_merge(PG_FUNCTION_ARGS) {
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+    pgqsMergeRow *rows;
+
+    if (SRF_IS_FIRSTCALL()) {
+        TupleDesc tupdesc;
+        ArrayType *exports = PG_GETARG_ARRAYTYPE_P(0);
+        Datum *elems;
+        bool *elem_nulls;
+        int nelems;
+        int nrows = 0;
+        int maxrows = 1024;
+        int out = 0;
+        int i;
+        int j;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        tupdesc = CreateTemplateTupleDesc(11);
+        TupleDescInitEntry(tupdesc, 1, "queryid", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 2, "query_text", TEXTOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 3, "sources", INT4OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 4, "calls", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 5, "total_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 6, "min_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 7, "max_time", FLOAT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 8, "temp_blks_read", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 9, "temp_blks_written", INT8OID, -1, 0);
+        TupleDescInitEntry(tupdesc, 10, "hist_calls", INT8ARRAYOID, -1, 0);
+        TupleDescInitEntry(tupdesc, 11, "hist_time", FLOAT8ARRAYOID, -1, 0);
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        deconstruct_array(exports, BYTEAOID, -1, false, TYPALIGN_INT,
+                          &elems, &elem_nulls, &nelems);
+
+        rows = palloc_extended(maxrows * sizeof(pgqsMergeRow), MCXT_ALLOC_HUGE);
+        for (i = 0; i < nelems; i++) {
+            if (elem_nulls[i])
+                continue;
+            nrows = pgqs_decode_export(DatumGetByteaPP(elems[i]), &rows, nrows, &maxrows);
+        }
+
+        qsort(rows, nrows, sizeof(pgqsMergeRow), pgqs_merge_row_cmp);
+
+        /* Fold runs of the same queryid into their first row */
+        for (i = 0; i < nrows; i++) {
+            pgqsMergeRow *dst;
+
+            if (out > 0 && rows[out - 1].queryid == rows[i].queryid) {
+                dst = &rows[out - 1];
+                dst->sources++;
+                dst->calls += rows[i].calls;
+                dst->total_time += rows[i].total_time;
+                dst->min_time = Min(dst->min_time, rows[i].min_time);
+                dst->max_time = Max(dst->max_time, rows[i].max_time);
+                dst->temp_blks_read += rows[i].temp_blks_read;
+                dst->temp_blks_written += rows[i].temp_blks_written;
+                for (j = 0; j < CONCURRENCY_BUCKETS; j++) {
+                    dst->concurrency_hist[j] += rows[i].concurrency_hist[j];
+                    dst->concurrency_hist_time[j] += rows[i].concurrency_hist_time[j];
+                }
+                continue;
+            }
+
+            if (out != i)
+                rows[out] = rows[i];
+            out++;
+        }
+
+        funcctx->user_fctx = rows;
+        funcctx->max_calls = out;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    rows = (pgqsMergeRow *) funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls) {
+        Datum values[11];
+        bool nulls[11] = {false};
+        Datum hist_calls[CONCURRENCY_BUCKETS];
+        Datum hist_time[CONCURRENCY_BUCKETS];
+        HeapTuple tuple;
+        pgqsMergeRow *row = &rows[funcctx->call_cntr];
+        int j;
+
+        for (j = 0; j < CONCURRENCY_BUCKETS; j++) {
+            hist_calls[j] = Int64GetDatum((int64) row->concurrency_hist[j]);
+            hist_time[j] = Float8GetDatum(row->concurrency_hist_time[j]);
+        }
+
+        values[0] = Int64GetDatum((int64) row->queryid);
+        values[1] = CStringGetTextDatum(row->query_text);
+        values[2] = Int32GetDatum(row->sources);
+        values[3] = Int64GetDatum((int64) row->calls);
+        values[4] = Float8GetDatum(row->total_time);
+        values[5] = Float8GetDatum(row->min_time);
+        values[6] = Float8GetDatum(row->max_time);
+        values[7] = Int64GetDatum(row->temp_blks_read);
+        values[8] = Int64GetDatum(row->temp_blks_written);
+        values[9] = PointerGetDatum(construct_array(hist_calls, CONCURRENCY_BUCKETS, INT8OID,
+                                                    sizeof(int64), FLOAT8PASSBYVAL, TYPALIGN_DOUBLE));
+        values[10] = PointerGetDatum(construct_array(hist_time, CONCURRENCY_BUCKETS, FLOAT8OID,
+                                                     sizeof(float8), FLOAT8PASSBYVAL, TYPALIGN_DOUBLE));
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+/* Statement counters copied out for bulk output */
+typedef struct {
+    uint64 queryid;
+    uint64 calls;
+    double total_time;
+    double min_time;
+    double max_time;
+    int text_offset;            /* into the shared text buffer */
+    int text_len;
+} pgqsBulkRow;
+
+/* Copy the statement table under one shared lock; texts go to texts */
+static pgqsBulkRow *pgqs_bulk_rows(int *nrows, StringInfo texts)
+{
+    pgqsBulkRow *rows;
+    int i;
+
+    LWLockAcquire(shared_state->lock, LW_SHARED);
+
+    *nrows = shared_state->num_entries;
+    rows = palloc(Max(*nrows, 1) * sizeof(pgqsBulkRow));
+
+    for (i = 0; i < *nrows; i++) {
+        QueryStatEntry *entry = &shared_state->entries[i];
+        char *text;
+
+        rows[i].queryid = entry->queryid;
+        rows[i].calls = entry->calls;
+        rows[i].total_time = entry->total_time;
+        rows[i].min_time = entry->min_time;
+        rows[i].max_time = entry->max_time;
+        rows[i].text_offset = texts->len;
+        text = pgqs_fetch_text(entry->text_id);
+        rows[i].text_len = strlen(text);
+        appendBinaryStringInfo(texts, text, rows[i].text_len + 1);
+        pfree(text);
+    }
+
+    LWLockRelease(shared_state->lock);
+
+    return rows;
+}
+
+/* pg_query_stats_json: the statement table as one JSON array */
+Datum pg_query_stats_json(PG_FUNCTION_ARGS) {
+    StringInfoData texts;
+    StringInfoData buf;
+    pgqsBulkRow *rows;
+    int nrows;
+    int i;
+
+    initStringInfo(&texts);
+    rows = pgqs_bulk_rows(&nrows, &texts);
+
+    initStringInfo(&buf);
+    appendStringInfoChar(&buf, '[');
+
+    for (i = 0; i < nrows; i++) {
+        if (i > 0)
+            appendStringInfoChar(&buf, ',');
+        appendStringInfo(&buf, "{\"queryid\":" INT64_FORMAT ",\"query_text\":",
+                         (int64) rows[i].queryid);
+        escape_json(&buf, texts.data + rows[i].text_offset);
+        appendStringInfo(&buf, ",\"calls\":" UINT64_FORMAT
+                         ",\"total_time\":%.17g,\"min_time\":%.17g,\"max_time\":%.17g}",
+                         rows[i].calls, rows[i].total_time,
+                         rows[i].min_time, rows[i].max_time);
+    }
+
+    appendStringInfoChar(&buf, ']');
+
+    /* json is stored as its text, as the built-in json functions return it */
+    PG_RETURN_TEXT_P(cstring_to_text_with_len(buf.data, buf.len));
+}
+
+/*
+ * Minimal FlatBuffers writer for Arrow IPC metadata.  Objects are written
+ * front to back, children after their parents, so every uoffset points
+ * forward; positions are relative to the start of the flatbuffer, which
+ * the caller keeps 8-byte aligned.
+ */
+typedef struct {
+    int size;                   /* 0: field absent */
+    int64 value;
+    bool is_offset;             /* uoffset patched later with pgqs_fb_patch */
+} pgqsFbField;
+
+static void pgqs_fb_align(StringInfo buf, int align)
+{
+    while (buf->len % align != 0)
+        appendStringInfoCharMacro(buf, '\0');
+}
+
+static void pgqs_fb_scalar(StringInfo buf, int64 value, int size)
+{
+    /* Arrow metadata is little-endian, as is every supported host */
+    appendBinaryStringInfo(buf, (char *) &value, size);
+}
+
+/* Write a vtable and its table; offset slots of the table go to slots */
+static int pgqs_fb_table(StringInfo buf, int nfields, const pgqsFbField *fields, int *slots)
+{
+    int offsets[16];
+    int table_size = 4;
+    int vtable_pos;
+    int table_pos;
+    int i;
+
+    Assert(nfields <= lengthof(offsets));
+
+    for (i = 0; i < nfields; i++) {
+        if (fields[i].size == 0) {
+            offsets[i] = 0;
+            continue;
+        }
+        table_size = TYPEALIGN(fields[i].size, table_size);
+        offsets[i] = table_size;
+        table_size += fields[i].size;
+    }
+
+    pgqs_fb_align(buf, 2);
+    vtable_pos = buf->len;
+    pgqs_fb_scalar(buf, 4 + 2 * nfields, 2);
+    pgqs_fb_scalar(buf, table_size, 2);
+    for (i = 0; i < nfields; i++)
+        pgqs_fb_scalar(buf, offsets[i], 2);
+
+    pgqs_fb_align(buf, 8);
+    table_pos = buf->len;
+    pgqs_fb_scalar(buf, table_pos - vtable_pos, 4);
+
+    for (i = 0; i < nfields; i++) {
+        if (fields[i].size == 0)
+            continue;
+        while (buf->len < table_pos + offsets[i])
+            appendStringInfoCharMacro(buf, '\0');
+        if (fields[i].is_offset && slots)
+            slots[i] = buf->len;
+        pgqs_fb_scalar(buf, fields[i].is_offset ? 0 : fields[i].value, fields[i].size);
+    }
+
+    return table_pos;
+}
+
+/* Point the uoffset at slot to target */
+static void pgqs_fb_patch(StringInfo buf, int slot, int target)
+{
+    uint32 offset = target - slot;
+
+    memcpy(buf->data + slot, &offset, sizeof(offset));
+}
+
+static int pgqs_fb_string(StringInfo buf, const char *str)
+{
+    int pos;
+    int len = strlen(str);
+
+    pgqs_fb_align(buf, 4);
+    pos = buf->len;
+    pgqs_fb_scalar(buf, len, 4);
+    appendBinaryStringInfo(buf, str, len + 1);
+
+    return pos;
+}
+
+/* Vector of n uoffsets, returning its position; element i is at pos + 4 + 4i */
+static int pgqs_fb_offset_vector(StringInfo buf, int n)
+{
+    int pos;
+    int i;
+
+    pgqs_fb_align(buf, 4);
+    pos = buf->len;
+    pgqs_fb_scalar(buf, n, 4);
+    for (i = 0; i < n; i++)
+        pgqs_fb_scalar(buf, 0, 4);
+
+    return pos;
+}
+
+/* Vector of n structs of two int64s, with their elements 8-byte aligned */
+static int pgqs_fb_pair_vector(StringInfo buf, int n, const int64 *pairs)
+{
+    int pos;
+    int i;
+
+    pgqs_fb_align(buf, 4);
+    if ((buf->len + 4) % 8 != 0)
+        pgqs_fb_scalar(buf, 0, 4);
+    pos = buf->len;
+    pgqs_fb_scalar(buf, n, 4);
+    for (i = 0; i < 2 * n; i++)
+        pgqs_fb_scalar(buf, pairs[i], 8);
+
+    return pos;
+}
+
+/*
+ * Message table as the flatbuffer root; returns the slot of its header
+ * uoffset.
+ */
+static int pgqs_fb_message(StringInfo buf, int header_type, int64 body_length)
+{
+    pgqsFbField fields[4];
+    int slots[4];
+    int table_pos;
+
+    memset(fields, 0, sizeof(fields));
+    fields[0].size = 2;         /* version */
+    fields[0].value = ARROW_METADATA_V5;
+    fields[1].size = 1;         /* header_type */
+    fields[1].value = header_type;
+    fields[2].size = 4;         /* header */
+    fields[2].is_offset = true;
+    fields[3].size = 8;         /* bodyLength */
+    fields[3].value = body_length;
+
+    pgqs_fb_scalar(buf, 0, 4);  /* root uoffset */
+    table_pos = pgqs_fb_table(buf, 4, fields, slots);
+    pgqs_fb_patch(buf, 0, table_pos);
+
+    return slots[2];
+}
+
+/* Append an encapsulated IPC message: continuation, length, metadata */
+static void pgqs_arrow_message(StringInfo out, StringInfo meta)
+{
+    pgqs_fb_align(meta, 8);
+    pgqs_fb_scalar(out, -1, 4);
+    pgqs_fb_scalar(out, meta->len, 4);
+    appendBinaryStringInfo(out, meta->data, meta->len);
+}
+
+static void pgqs_arrow_schema(StringInfo out)
+{
+    static const char *const names[ARROW_NUM_COLUMNS] = {
+        "queryid", "calls", "total_time", "min_time", "max_time", "query_text"
+    };
+    StringInfoData meta;
+    pgqsFbField fields[7];
+    int slots[7];
+    int header_slot;
+    int schema_pos;
+    int vector_pos;
+    int i;
+
+    initStringInfo(&meta);
+    header_slot = pgqs_fb_message(&meta, ARROW_HEADER_SCHEMA, 0);
+
+    memset(fields, 0, sizeof(fields));
+    fields[1].size = 4;         /* Schema.fields */
+    fields[1].is_offset = true;
+    schema_pos = pgqs_fb_table(&meta, 2, fields, slots);
+    pgqs_fb_patch(&meta, header_slot, schema_pos);
+
+    vector_pos = pgqs_fb_offset_vector(&meta, ARROW_NUM_COLUMNS);
+    pgqs_fb_patch(&meta, slots[1], vector_pos);
+
+    for (i = 0; i < ARROW_NUM_COLUMNS; i++) {
+        int type_type = i < 2 ? ARROW_TYPE_INT :
+                        i < 5 ? ARROW_TYPE_FLOATING_POINT : ARROW_TYPE_UTF8;
+        pgqsFbField type_fields[2];
+        int field_pos;
+        int pos;
+
+        memset(fields, 0, sizeof(fields));
+        fields[0].size = 4;     /* name */
+        fields[0].is_offset = true;
+        fields[2].size = 1;     /* type_type */
+        fields[2].value = type_type;
+        fields[3].size = 4;     /* type */
+        fields[3].is_offset = true;
+        fields[5].size = 4;     /* children */
+        fields[5].is_offset = true;
+        field_pos = pgqs_fb_table(&meta, 6, fields, slots);
+        pgqs_fb_patch(&meta, vector_pos + 4 + 4 * i, field_pos);
+
+        pos = pgqs_fb_string(&meta, names[i]);
+        pgqs_fb_patch(&meta, slots[0], pos);
+
+        memset(type_fields, 0, sizeof(type_fields));
+        if (type_type == ARROW_TYPE_INT) {
+            type_fields[0].size = 4;    /* bitWidth */
+            type_fields[0].value = 64;
+            type_fields[1].size = 1;    /* is_signed */
+            type_fields[1].value = 1;
+            pos = pgqs_fb_table(&meta, 2, type_fields, NULL);
+        } else if (type_type == ARROW_TYPE_FLOATING_POINT) {
+            type_fields[0].size = 2;    /* precision */
+            type_fields[0].value = ARROW_PRECISION_DOUBLE;
+            pos = pgqs_fb_table(&meta, 1, type_fields, NULL);
+        } else {
+            pos = pgqs_fb_table(&meta, 0, type_fields, NULL);
+        }
+        pgqs_fb_patch(&meta, slots[3], pos);
+
+        pos = pgqs_fb_offset_vector(&meta, 0);
+        pgqs_fb_patch(&meta, slots[5], pos);
+    }
+
+    pgqs_arrow_message(out, &meta);
+}
+
+/* Append a body buffer, padded to 8 bytes, and record its (offset, length) */
+static void pgqs_arrow_buffer(StringInfo body, const void *data, int len, int64 *buffer)
+{
+    buffer[0] = body->len;
+    buffer[1] = len;
+    if (len > 0)
+        appendBinaryStringInfo(body, data, len);
+    pgqs_fb_align(body, 8);
+}
+
+/*
+ * pg_query_stats_arrow: the statement table as an Arrow IPC stream (schema,
+ * one record batch, end-of-stream marker).
+ */
+Datum pg_query_stats_arrow(PG_FUNCTION_ARGS) {
+    StringInfoData texts;
+    StringInfoData body;
+    StringInfoData meta;
+    StringInfoData out;
+    pgqsBulkRow *rows;
+    int nrows;
+    int64 *ints;
+    double *floats;
+    int32 *text_offsets;
+    int64 nodes[2 * ARROW_NUM_COLUMNS];
+    int64 buffers[2 * (2 * ARROW_NUM_COLUMNS + 1)];
+    int nbuffers = 0;
+    pgqsFbField fields[3];
+    int slots[3];
+    int header_slot;
+    int pos;
+    int col;
+    int i;
+
+#ifdef WORDS_BIGENDIAN
+    ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+             errmsg("pg_query_stats: Arrow output is only supported on little-endian servers")));
+#endif
+
+    initStringInfo(&texts);
+    rows = pgqs_bulk_rows(&nrows, &texts);
+
+    ints = palloc(Max(nrows, 1) * sizeof(int64));
+    floats = palloc(Max(nrows, 1) * sizeof(double));
+    text_offsets = palloc((nrows + 1) * sizeof(int32));
+
+    /* Body: per column an empty validity bitmap, then the values */
+    initStringInfo(&body);
+    for (col = 0; col < ARROW_NUM_COLUMNS; col++) {
+        nodes[2 * col] = nrows;
+        nodes[2 * col + 1] = 0;
+
+        pgqs_arrow_buffer(&body, NULL, 0, &buffers[2 * nbuffers++]);
+
+        switch (col)
+        {
+            case 0:
+            case 1:
+                for (i = 0; i < nrows; i++)
+                    ints[i] = (int64) (col == 0 ? rows[i].queryid : rows[i].calls);
+                pgqs_arrow_buffer(&body, ints, nrows * sizeof(int64), &buffers[2 * nbuffers++]);
+                break;
+            case 2:
+            case 3:
+            case 4:
+                for (i = 0; i < nrows; i++)
+                    floats[i] = col == 2 ? rows[i].total_time :
+                                col == 3 ? rows[i].min_time : rows[i].max_time;
+                pgqs_arrow_buffer(&body, floats, nrows * sizeof(double), &buffers[2 * nbuffers++]);
+                break;
+            default:
+                {
+                    StringInfoData data;
+
+                    initStringInfo(&data);
+                    for (i = 0; i < nrows; i++) {
+                        text_offsets[i] = data.len;
+                        appendBinaryStringInfo(&data, texts.data + rows[i].text_offset,
+                                               rows[i].text_len);
+                    }
+                    text_offsets[nrows] = data.len;
+                    pgqs_arrow_buffer(&body, text_offsets, (nrows + 1) * sizeof(int32),
+                                      &buffers[2 * nbuffers++]);
+                    pgqs_arrow_buffer(&body, data.data, data.len, &buffers[2 * nbuffers++]);
+                }
+                break;
+        }
+    }
+
+    pq_begintypsend(&out);
+    pgqs_arrow_schema(&out);
+
+    initStringInfo(&meta);
+    header_slot = pgqs_fb_message(&meta, ARROW_HEADER_RECORD_BATCH, body.len);
+
+    memset(fields, 0, sizeof(fields));
+    fields[0].size = 8;         /* length */
+    fields[0].value = nrows;
+    fields[1].size = 4;         /* nodes */
+    fields[1].is_offset = true;
+    fields[2].size = 4;         /* buffers */
+    fields[2].is_offset = true;
+    pos = pgqs_fb_table(&meta, 3, fields, slots);
+    pgqs_fb_patch(&meta, header_slot, pos);
+
+    pos = pgqs_fb_pair_vector(&meta, ARROW_NUM_COLUMNS, nodes);
+    pgqs_fb_patch(&meta, slots[1], pos);
+    pos = pgqs_fb_pair_vector(&meta, nbuffers, buffers);
+    pgqs_fb_patch(&meta, slots[2], pos);
+
+    pgqs_arrow_message(&out, &meta);
+    appendBinaryStringInfo(&out, body.data, body.len);
+
+    /* End-of-stream marker */
+    pgqs_fb_scalar(&out, -1, 4);
+    pgqs_fb_scalar(&out, 0, 4);
+
+    PG_RETURN_BYTEA_P(pq_endtypsend(&out));
+}
+
+/* pg_query_stats_capture_info: records captured and dropped */
+Datum pg_query_stats_capture_info(PG_FUNCTION_ARGS) {
+    TupleDesc tupdesc;
+    Datum values[2];
+    bool nulls[2] = {false};
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "pg_query_stats: return type must be a row type");
+
+    if (capture_queue) {
+        values[0] = Int64GetDatum((int64) pg_atomic_read_u64(&capture_queue->captured));
+        values[1] = Int64GetDatum((int64) pg_atomic_read_u64(&capture_queue->dropped));
+    } else {
+        nulls[0] = true;
+        nulls[1] = true;
+    }
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+/* pg_query_stats_info: table usage and text store savings */
+Datum pg_query_stats_info(PG_FUNCTION_ARGS) {
+    TupleDesc tupdesc;
+    Datum values[8];
+    bool nulls[8] = {false};
+    int64 text_bytes = 0;
+    int entries;
+    int i;
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "pg_query_stats: return type must be a row type");
+
+    LWLockAcquire(shared_state->lock, LW_SHARED);
+    entries = shared_state->num_entries;
+    LWLockRelease(shared_state->lock);
+
+    LWLockAcquire(text_store->lock, LW_SHARED);
+
+    /* What the texts would take uncompressed, in every entry using them */
+    for (i = 0; i < text_store->num_texts; i++)
+        text_bytes += (int64) text_store->texts[i].raw_len * text_store->texts[i].refs;
+
+    values[0] = Int32GetDatum(entries);
+    values[1] = Int32GetDatum(pgqs_max_entries);
+    values[2] = Int32GetDatum(text_store->num_texts);
+    values[3] = Int64GetDatum(text_bytes);
+    values[4] = Int64GetDatum((int64) text_store->data_used);
+    values[5] = Int64GetDatum(text_bytes - (int64) text_store->data_used);
+    values[6] = Int64GetDatum((int64) text_store->data_size);
+    values[7] = Int64GetDatum((int64) text_store->truncated);
+
+    LWLockRelease(text_store->lock);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+/* pg_query_stats_reset */
+Datum pg_query_stats_reset(PG_FUNCTION_ARGS) {
+    /* Statement and failure entries go with the texts they refer to */
+    LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
+    LWLockAcquire(failure_state->lock, LW_EXCLUSIVE);
+    LWLockAcquire(text_store->lock, LW_EXCLUSIVE);
+    shared_state->num_entries = 0;
+    shared_state->generation++;
+    failure_state->num_entries = 0;
+    text_store->num_texts = 0;
+    text_store->data_used = 0;
+    text_store->truncated = 0;
+    LWLockRelease(text_store->lock);
+    LWLockRelease(failure_state->lock);
+    LWLockRelease(shared_state->lock);
+
+    LWLockAcquire(plan_node_state->lock, LW_EXCLUSIVE);
+    plan_node_state->num_entries = 0;
+    LWLockRelease(plan_node_state->lock);
+
+    LWLockAcquire(seq_scan_state->lock, LW_EXCLUSIVE);
+    seq_scan_state->num_entries = 0;
+    LWLockRelease(seq_scan_state->lock);
+
+    LWLockAcquire(wait_state->lock, LW_EXCLUSIVE);
+    wait_state->num_entries = 0;
+    LWLockRelease(wait_state->lock);
+
+    LWLockAcquire(xact_state->lock, LW_EXCLUSIVE);
+    xact_state->num_entries = 0;
+    LWLockRelease(xact_state->lock);
+
+    LWLockAcquire(xact_gap_state->lock, LW_EXCLUSIVE);
+    xact_gap_state->num_entries = 0;
+    LWLockRelease(xact_gap_state->lock);
+
+    LWLockAcquire(application_state->lock, LW_EXCLUSIVE);
+    application_state->num_entries = 0;
+    LWLockRelease(application_state->lock);
+
+    LWLockAcquire(relation_state->lock, LW_EXCLUSIVE);
+    relation_state->num_entries = 0;
+    LWLockRelease(relation_state->lock);
+
+    LWLockAcquire(index_state->lock, LW_EXCLUSIVE);
+    index_state->num_entries = 0;
+    LWLockRelease(index_state->lock);
+
+    {
+        int i;
+
+        for (i = 0; i < PGQS_NUM_CMDTYPES; i++)
+            pgqs_reset_counter(&workload_state->cmdtypes[i]);
+        for (i = 0; i < COMMAND_TAG_NEXTTAG; i++)
+            pgqs_reset_counter(&workload_state->cmdtags[i]);
+        for (i = 0; i < MAX_DATABASE_COUNTERS; i++)
+            pgqs_reset_counter(&workload_state->databases[i]);
+        pgqs_reset_counter(&workload_state->other_databases);
+    }
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * One sampling round: attribute the current wait event of every backend
+ * with a statement in flight to that statement.
+ */
+static void pgqs_sample_waits(void)
+{
+    WaitStatEntry *samples;
+    int nsamples = 0;
+    int i;
+    int j;
+
+    samples = palloc(num_backend_slots * sizeof(WaitStatEntry));
+
+    for (i = 0; i < num_backend_slots; i++) {
+        uint64 queryid = pg_atomic_read_u64(&backend_slots[i].queryid);
+        volatile PGPROC *proc = &ProcGlobal->allProcs[i];
+
+        if (queryid == 0)
+            continue;
+
+        samples[nsamples].queryid = queryid;
+        samples[nsamples].wait_event_info = proc->wait_event_info;
+        nsamples++;
+    }
+
+    if (nsamples == 0) {
+        pfree(samples);
+        return;
+    }
+
+    LWLockAcquire(wait_state->lock, LW_EXCLUSIVE);
+
+    for (i = 0; i < nsamples; i++) {
+        WaitStatEntry *entry = NULL;
+
+        for (j = 0; j < wait_state->num_entries; j++) {
+            WaitStatEntry *e = &wait_state->entries[j];
+
+            if (e->queryid == samples[i].queryid &&
+                e->wait_event_info == samples[i].wait_event_info) {
+                entry = e;
+                break;
+            }
+        }
+
+        if (!entry) {
+            if (wait_state->num_entries >= MAX_WAIT_ENTRIES)
+                continue;
+            entry = &wait_state->entries[wait_state->num_entries++];
+            entry->queryid = samples[i].queryid;
+            entry->wait_event_info = samples[i].wait_event_info;
+            entry->samples = 0;
+            entry->time = 0.0;
+        }
+
+        entry->samples++;
+        entry->time += pgqs_wait_sample_interval;
+    }
+
+    LWLockRelease(wait_state->lock);
+
+    pfree(samples);
+}
+
+/* Wait event sampler background worker */
+void pgqs_wait_sampler_main(Datum main_arg) {
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    elog(LOG, "pg_query_stats: wait sampler started");
+
+    for (;;) {
+        (void) WaitLatch(MyLatch,
+                         WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                         pgqs_wait_sample_interval,
+                         PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+
+        CHECK_FOR_INTERRUPTS();
+
+        if (ConfigReloadPending) {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        pgqs_sample_waits();
+    }
+}
+
+/* Statement counters copied out for the exporter */
+typedef struct {
+    uint64 queryid;
+    uint64 calls;
+    double total_time;
+    double max_time;
+    uint64 concurrency_hist[CONCURRENCY_BUCKETS];
+} pgqsExportRow;
+
+static const char *const pgqs_concurrency_labels[CONCURRENCY_BUCKETS] = {
+    "1", "2", "3-4", "5-8", "9-16", "17-32", "33-64", "65+"
+};
+
+static int pgqs_export_row_cmp(const void *a, const void *b)
+{
+    double ta = ((const pgqsExportRow *) a)->total_time;
+    double tb = ((const pgqsExportRow *) b)->total_time;
+
+    return (ta < tb) ? 1 : (ta > tb) ? -1 : 0;
+}
+
+/* One workload counter as a sample of the calls or the time family */
+static void pgqs_write_workload_sample(StringInfo buf, bool time, const char *label,
+                                       const char *value, pgqsCounter *counter)
+{
+    if (time)
+        appendStringInfo(buf, "pg_query_stats_workload_time_seconds_total{%s=\"%s\"} %.6f\n",
+                         label, value,
+                         (double) pg_atomic_read_u64(&counter->time_us) / 1000000.0);
+    else
+        appendStringInfo(buf, "pg_query_stats_workload_calls_total{%s=\"%s\"} " UINT64_FORMAT "\n",
+                         label, value, pg_atomic_read_u64(&counter->calls));
+}
+
+/*
+ * All samples of one workload family.  OpenMetrics wants each family's
+ * samples together, so the calls and time families are written in turn.
+ */
+static void pgqs_write_workload(StringInfo buf, bool time)
+{
+    char dbid[16];
+    int i;
+
+    for (i = 0; i < PGQS_NUM_CMDTYPES; i++)
+        if (pg_atomic_read_u64(&workload_state->cmdtypes[i].calls) != 0)
+            pgqs_write_workload_sample(buf, time, "command_type",
+                                       pgqs_cmdtype_name((CmdType) i),
+                                       &workload_state->cmdtypes[i]);
+
+    for (i = 0; i < COMMAND_TAG_NEXTTAG; i++)
+        if (pg_atomic_read_u64(&workload_state->cmdtags[i].calls) != 0)
+            pgqs_write_workload_sample(buf, time, "command_tag",
+                                       GetCommandTagName((CommandTag) i),
+                                       &workload_state->cmdtags[i]);
+
+    for (i = 0; i < MAX_DATABASE_COUNTERS; i++) {
+        uint32 db = pg_atomic_read_u32(&workload_state->dbids[i]);
+
+        if (db == InvalidOid || pg_atomic_read_u64(&workload_state->databases[i].calls) == 0)
+            continue;
+
+        snprintf(dbid, sizeof(dbid), "%u", db);
+        pgqs_write_workload_sample(buf, time, "dbid", dbid, &workload_state->databases[i]);
+    }
+
+    /* databases that found no counter of their own */
+    if (pg_atomic_read_u64(&workload_state->other_databases.calls) != 0)
+        pgqs_write_workload_sample(buf, time, "dbid", "other",
+                                   &workload_state->other_databases);
+}
+
+/*
+ * Render the metrics in OpenMetrics text format.  Statement counters are
+ * copied under a shared lock, then formatted; the atomic counters are
+ * read directly.
+ */
+static void pgqs_write_metrics(StringInfo buf, double last_scrape, uint64 scrapes)
+{
+    pgqsExportRow *rows;
+    int nrows;
+    int entries;
+    int max_entries;
+    int i;
+    int j;
+
+    LWLockAcquire(shared_state->lock, LW_SHARED);
+
+    entries = nrows = shared_state->num_entries;
+    max_entries = pgqs_max_entries;
+    rows = palloc(Max(nrows, 1) * sizeof(pgqsExportRow));
+
+    for (i = 0; i < nrows; i++) {
+        QueryStatEntry *entry = &shared_state->entries[i];
+
+        rows[i].queryid = entry->queryid;
+        rows[i].calls = entry->calls;
+        rows[i].total_time = entry->total_time;
+        rows[i].max_time = entry->max_time;
+        for (j = 0; j < CONCURRENCY_BUCKETS; j++)
+            rows[i].concurrency_hist[j] = pg_atomic_read_u64(&entry->concurrency_hist[j]);
+    }
+
+    LWLockRelease(shared_state->lock);
+
+    qsort(rows, nrows, sizeof(pgqsExportRow), pgqs_export_row_cmp);
+    nrows = Min(nrows, pgqs_exporter_top_n);
+
+    appendStringInfoString(buf,
+                           "# TYPE pg_query_stats_entries gauge\n"
+                           "# HELP pg_query_stats_entries Statements currently tracked.\n");
+    appendStringInfo(buf, "pg_query_stats_entries %d\n", entries);
+    appendStringInfoString(buf,
+                           "# TYPE pg_query_stats_entries_max gauge\n"
+                           "# HELP pg_query_stats_entries_max Capacity of the statement table.\n");
+    appendStringInfo(buf, "pg_query_stats_entries_max %d\n", max_entries);
+
+    appendStringInfoString(buf,
+                           "# TYPE pg_query_stats_calls counter\n"
+                           "# HELP pg_query_stats_calls Executions of the statements with the most total time.\n");
+    for (i = 0; i < nrows; i++)
+        appendStringInfo(buf, "pg_query_stats_calls_total{queryid=\"" INT64_FORMAT "\"} " UINT64_FORMAT "\n",
+                         (int64) rows[i].queryid, rows[i].calls);
+
+    appendStringInfoString(buf,
+                           "# TYPE pg_query_stats_time_seconds counter\n"
+                           "# UNIT pg_query_stats_time_seconds seconds\n"
+                           "# HELP pg_query_stats_time_seconds Execution time of the statements with the most total time.\n");
+    for (i = 0; i < nrows; i++)
+        appendStringInfo(buf, "pg_query_stats_time_seconds_total{queryid=\"" INT64_FORMAT "\"} %.6f\n",
+                         (int64) rows[i].queryid, rows[i].total_time / 1000.0);
+
+    appendStringInfoString(buf,
+                           "# TYPE pg_query_stats_max_time_seconds gauge\n"
+                           "# UNIT pg_query_stats_max_time_seconds seconds\n"
+                           "# HELP pg_query_stats_max_time_seconds Slowest execution of the statements with the most total time.\n");
+    for (i = 0; i < nrows; i++)
+        appendStringInfo(buf, "pg_query_stats_max_time_seconds{queryid=\"" INT64_FORMAT "\"} %.6f\n",
+                         (int64) rows[i].queryid, rows[i].max_time / 1000.0);
+
+    appendStringInfoString(buf,
+                           "# TYPE pg_query_stats_concurrency_starts counter\n"
+                           "# HELP pg_query_stats_concurrency_starts Starts by number of executions of the statement in flight.\n");
+    for (i = 0; i < nrows; i++)
+        for (j = 0; j < CONCURRENCY_BUCKETS; j++)
+            if (rows[i].concurrency_hist[j] != 0)
+                appendStringInfo(buf, "pg_query_stats_concurrency_starts_total{queryid=\"" INT64_FORMAT "\",concurrency=\"%s\"} " UINT64_FORMAT "\n",
+                                 (int64) rows[i].queryid, pgqs_concurrency_labels[j],
+                                 rows[i].concurrency_hist[j]);
+
+    appendStringInfoString(buf,
+                           "# TYPE pg_query_stats_workload_calls counter\n"
+                           "# HELP pg_query_stats_workload_calls Top-level statements by command type, command tag and database.\n");
+    pgqs_write_workload(buf, false);
+    appendStringInfoString(buf,
+                           "# TYPE pg_query_stats_workload_time_seconds counter\n"
+                           "# UNIT pg_query_stats_workload_time_seconds seconds\n"
+                           "# HELP pg_query_stats_workload_time_seconds Time of top-level statements by command type, command tag and database.\n");
+    pgqs_write_workload(buf, true);
+
+    appendStringInfoString(buf,
+                           "# TYPE pg_query_stats_exporter_scrapes counter\n"
+                           "# HELP pg_query_stats_exporter_scrapes Scrapes served by this exporter.\n");
+    appendStringInfo(buf, "pg_query_stats_exporter_scrapes_total " UINT64_FORMAT "\n", scrapes);
+    appendStringInfoString(buf,
+                           "# TYPE pg_query_stats_exporter_scrape_duration_seconds gauge\n"
+                           "# UNIT pg_query_stats_exporter_scrape_duration_seconds seconds\n"
+                           "# HELP pg_query_stats_exporter_scrape_duration_seconds Time spent rendering the previous scrape.\n");
+    appendStringInfo(buf, "pg_query_stats_exporter_scrape_duration_seconds %.6f\n", last_scrape);
+
+    appendStringInfoString(buf, "# EOF\n");
+
+    pfree(rows);
+}
+
+/* Open the exporter's listening socket, or return -1 */
+static pgsocket pgqs_exporter_listen_socket(const char *listen_addr)
+{
+    struct addrinfo hint;
+    struct addrinfo *addrs = NULL;
+    char *addr = NULL;
+    const char *host = NULL;
+    const char *service;
+    pgsocket sock;
+    int one = 1;
+    int ret;
+
+    memset(&hint, 0, sizeof(hint));
+    hint.ai_socktype = SOCK_STREAM;
+    hint.ai_flags = AI_PASSIVE;
+
+    if (is_absolute_path(listen_addr)) {
+        hint.ai_family = AF_UNIX;
+        service = listen_addr;
+        unlink(listen_addr);
+    } else {
+        char *colon;
+
+        addr = pstrdup(listen_addr);
+        colon = strrchr(addr, ':');
+        if (!colon) {
+            ereport(LOG,
+                    (errmsg("pg_query_stats: invalid exporter address \"%s\"", listen_addr),
+                     errhint("Use host:port or an absolute Unix socket path.")));
+            pfree(addr);
+            return PGINVALID_SOCKET;
+        }
+        *colon = '\0';
+        service = colon + 1;
+        hint.ai_family = AF_UNSPEC;
+        if (addr[0] != '\0')
+            host = addr;        /* ":port" listens on all addresses */
+    }
+
+    ret = pg_getaddrinfo_all(host, service, &hint, &addrs);
+    if (ret != 0 || !addrs) {
+        ereport(LOG,
+                (errmsg("pg_query_stats: could not resolve exporter address \"%s\": %s",
+                        listen_addr, gai_strerror(ret))));
+        if (addrs)
+            pg_freeaddrinfo_all(hint.ai_family, addrs);
+        if (addr)
+            pfree(addr);
+        return PGINVALID_SOCKET;
+    }
+
+    sock = socket(addrs->ai_family, SOCK_STREAM, 0);
+    if (sock == PGINVALID_SOCKET ||
+        (addrs->ai_family != AF_UNIX &&
+         setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *) &one, sizeof(one)) < 0) ||
+        bind(sock, addrs->ai_addr, addrs->ai_addrlen) < 0 ||
+        listen(sock, 16) < 0) {
+        ereport(LOG,
+                (errcode_for_socket_access(),
+                 errmsg("pg_query_stats: could not listen on \"%s\": %m", listen_addr)));
+        if (sock != PGINVALID_SOCKET)
+            closesocket(sock);
+        sock = PGINVALID_SOCKET;
+    }
+
+    pg_freeaddrinfo_all(hint.ai_family, addrs);
+    if (addr)
+        pfree(addr);
+
+    return sock;
+}
+
+/* Remove the exporter's Unix socket file at exit */
+static void pgqs_exporter_cleanup(int code, Datum arg)
+{
+    if (is_absolute_path(pgqs_exporter_listen))
+        unlink(pgqs_exporter_listen);
+}
+
+/* Answer one HTTP request on an accepted connection */
+static void pgqs_exporter_serve(pgsocket client, StringInfo body)
+{
+    struct timeval timeout = {1, 0};
+    char request[1024];
+    ssize_t len = 0;
+    StringInfoData response;
+    bool found;
+    const char *p;
+    size_t left;
+
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, (char *) &timeout, sizeof(timeout));
+
+    /* Only the request line matters; headers are not read */
+    while (len < (ssize_t) sizeof(request) - 1) {
+        ssize_t n = recv(client, request + len, sizeof(request) - 1 - len, 0);
+
+        if (n <= 0)
+            break;
+        len += n;
+        request[len] = '\0';
+        if (strchr(request, '\n'))
+            break;
+    }
+    request[len] = '\0';
+
+    found = strncmp(request, "GET /metrics ", 13) == 0 ||
+            strncmp(request, "GET / ", 6) == 0;
+
+    initStringInfo(&response);
+    if (found)
+        appendStringInfo(&response,
+                         "HTTP/1.0 200 OK\r\n"
+                         "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                         "Content-Length: %d\r\n"
+                         "Connection: close\r\n\r\n", body->len);
+    else
+        appendStringInfoString(&response,
+                               "HTTP/1.0 404 Not Found\r\n"
+                               "Content-Length: 0\r\n"
+                               "Connection: close\r\n\r\n");
+
+    p = response.data;
+    left = response.len;
+    while (left > 0) {
+        ssize_t n = send(client, p, left, 0);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        p += n;
+        left -= n;
+    }
+
+    p = body->data;
+    left = found ? body->len : 0;
+    while (left > 0) {
+        ssize_t n = send(client, p, left, 0);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        p += n;
+        left -= n;
+    }
+}
+
+/* OpenMetrics exporter background worker */
+void pgqs_exporter_main(Datum main_arg) {
+    pgsocket listen_sock;
+    MemoryContext scrape_context;
+    double last_scrape = 0.0;
+    uint64 scrapes = 0;
+
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    listen_sock = pgqs_exporter_listen_socket(pgqs_exporter_listen);
+    if (listen_sock == PGINVALID_SOCKET)
+        proc_exit(1);
+    on_proc_exit(pgqs_exporter_cleanup, (Datum) 0);
+
+    scrape_context = AllocSetContextCreate(TopMemoryContext,
+                                           "pg_query_stats exporter",
+                                           ALLOCSET_DEFAULT_SIZES);
+
+    elog(LOG, "pg_query_stats: exporter listening on \"%s\"", pgqs_exporter_listen);
+
+    for (;;) {
+        int rc;
+
+        rc = WaitLatchOrSocket(MyLatch,
+                               WL_LATCH_SET | WL_SOCKET_READABLE | WL_EXIT_ON_PM_DEATH,
+                               listen_sock, -1L,
+                               PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+
+        CHECK_FOR_INTERRUPTS();
+
+        if (ConfigReloadPending) {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        if (rc & WL_SOCKET_READABLE) {
+            pgsocket client = accept(listen_sock, NULL, NULL);
+            MemoryContext oldcontext;
+            StringInfoData body;
+            instr_time start;
+            instr_time duration;
+
+            if (client == PGINVALID_SOCKET)
+                continue;
+
+            oldcontext = MemoryContextSwitchTo(scrape_context);
+
+            INSTR_TIME_SET_CURRENT(start);
+            initStringInfo(&body);
+            pgqs_write_metrics(&body, last_scrape, ++scrapes);
+            INSTR_TIME_SET_CURRENT(duration);
+            INSTR_TIME_SUBTRACT(duration, start);
+            last_scrape = INSTR_TIME_GET_DOUBLE(duration);
+
+            pgqs_exporter_serve(client, &body);
+            closesocket(client);
+
+            MemoryContextSwitchTo(oldcontext);
+            MemoryContextReset(scrape_context);
+        }
+    }
+}
+
+/* Current capture file of the writer */
+static FILE *capture_file = NULL;
+static int64 capture_file_bytes = 0;
+
+static int pgqs_capture_name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/*
+ * Delete the oldest capture files so that at most keep remain.  File names
+ * carry their start time, so they sort by age.
+ */
+static void pgqs_capture_retain(int keep)
+{
+    DIR *dir;
+    struct dirent *de;
+    char **names;
+    int nnames = 0;
+    int maxnames = 64;
+    int i;
+
+    dir = AllocateDir(pgqs_capture_directory);
+    if (!dir) {
+        ereport(WARNING,
+                (errcode_for_file_access(),
+                 errmsg("pg_query_stats: could not open capture directory \"%s\": %m",
+                        pgqs_capture_directory)));
+        return;
+    }
+
+    names = palloc(maxnames * sizeof(char *));
+    while ((de = ReadDir(dir, pgqs_capture_directory)) != NULL) {
+        size_t len = strlen(de->d_name);
+
+        if (strncmp(de->d_name, "capture-", 8) != 0 || len < 6 ||
+            strcmp(de->d_name + len - 6, ".pgqsc") != 0)
+            continue;
+
+        if (nnames == maxnames) {
+            maxnames *= 2;
+            names = repalloc(names, maxnames * sizeof(char *));
+        }
+        names[nnames++] = pstrdup(de->d_name);
+    }
+    FreeDir(dir);
+
+    qsort(names, nnames, sizeof(char *), pgqs_capture_name_cmp);
+
+    for (i = 0; i < nnames - keep; i++) {
+        char *path = psprintf("%s/%s", pgqs_capture_directory, names[i]);
+
+        if (unlink(path) < 0 && errno != ENOENT)
+            ereport(WARNING,
+                    (errcode_for_file_access(),
+                     errmsg("pg_query_stats: could not remove capture file \"%s\": %m", path)));
+        pfree(path);
+    }
+
+    for (i = 0; i < nnames; i++)
+        pfree(names[i]);
+    pfree(names);
+}
+
+/* Open a new capture file, named after the current time */
+static void pgqs_capture_open(void)
+{
+    char *path;
+    StringInfoData header;
+
+    path = psprintf("%s/capture-" INT64_FORMAT ".pgqsc",
+                    pgqs_capture_directory, (int64) GetCurrentTimestamp());
+    capture_file = AllocateFile(path, PG_BINARY_W);
+    if (!capture_file)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("pg_query_stats: could not create capture file \"%s\": %m", path)));
+
+    initStringInfo(&header);
+    appendBinaryStringInfo(&header, CAPTURE_FILE_MAGIC, strlen(CAPTURE_FILE_MAGIC));
+    pq_sendint32(&header, CAPTURE_FILE_VERSION);
+    fwrite(header.data, 1, header.len, capture_file);
+    capture_file_bytes = header.len;
+
+    pfree(header.data);
+    pfree(path);
+
+    if (pgqs_capture_max_files > 0)
+        pgqs_capture_retain(pgqs_capture_max_files);
+}
+
+static void pgqs_capture_close(void)
+{
+    if (capture_file) {
+        FreeFile(capture_file);
+        capture_file = NULL;
+    }
+}
+
+static void pgqs_capture_writer_exit(int code, Datum arg)
+{
+    if (capture_queue)
+        capture_queue->writer_latch = NULL;
+    pgqs_capture_close();
+}
+
+/*
+ * Serialize a record in the capture file format, network byte order:
+ * length of the rest, start time, pid, session start, dbid, queryid,
+ * duration, flags, text, then each parameter as isnull, type, text.
+ */
+static void pgqs_capture_serialize(StringInfo buf, pgqsCaptureRecord *record)
+{
+    int length_pos = buf->len;
+    const char *p = record->params;
+    uint32 length;
+    int i;
+
+    pq_sendint32(buf, 0);
+    pq_sendint64(buf, record->start_time);
+    pq_sendint32(buf, record->pid);
+    pq_sendint64(buf, record->session_start);
+    pq_sendint32(buf, record->dbid);
+    pq_sendint64(buf, (int64) record->queryid);
+    pq_sendfloat8(buf, record->duration);
+    pq_sendint16(buf, record->truncated ? 1 : 0);
+    pq_sendint16(buf, record->text_len);
+    pq_sendbytes(buf, record->text, record->text_len);
+    pq_sendint16(buf, record->nparams);
+
+    for (i = 0; i < record->nparams; i++) {
+        uint32 typid;
+        uint16 len;
+        bool isnull = *p++;
+
+        memcpy(&typid, p, sizeof(typid));
+        p += sizeof(typid);
+        memcpy(&len, p, sizeof(len));
+        p += sizeof(len);
+
+        pq_sendbyte(buf, isnull ? 1 : 0);
+        pq_sendint32(buf, typid);
+        pq_sendint16(buf, len);
+        pq_sendbytes(buf, p, len);
+        p += len;
+    }
+
+    length = pg_hton32(buf->len - length_pos - 4);
+    memcpy(buf->data + length_pos, &length, sizeof(length));
+}
+
+/* Move every queued record to the capture file */
+static void pgqs_capture_drain(StringInfo buf)
+{
+    resetStringInfo(buf);
+
+    for (;;) {
+        uint64 pos = capture_queue->dequeue_pos;
+        pgqsCaptureCell *cell = &capture_queue->cells[pos & (CAPTURE_QUEUE_SIZE - 1)];
+
+        if (pg_atomic_read_u64(&cell->sequence) != pos + 1)
+            break;
+
+        pg_read_barrier();
+        pgqs_capture_serialize(buf, &cell->record);
+        pg_memory_barrier();
+        pg_atomic_write_u64(&cell->sequence, pos + CAPTURE_QUEUE_SIZE);
+        capture_queue->dequeue_pos = pos + 1;
+    }
+
+    if (buf->len == 0)
+        return;
+
+    if (!capture_file)
+        pgqs_capture_open();
+
+    if (fwrite(buf->data, 1, buf->len, capture_file) != buf->len || fflush(capture_file) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("pg_query_stats: could not write capture file: %m")));
+
+    capture_file_bytes += buf->len;
+    if (capture_file_bytes >= (int64) pgqs_capture_file_size * 1024 * 1024)
+        pgqs_capture_close();
+}
+
+/* Workload capture writer background worker */
+void pgqs_capture_writer_main(Datum main_arg) {
+    StringInfoData buf;
+
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    if (MakePGDirectory(pgqs_capture_directory) < 0 && errno != EEXIST)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("pg_query_stats: could not create capture directory \"%s\": %m",
+                        pgqs_capture_directory)));
+
+    capture_queue->writer_latch = MyLatch;
+    on_proc_exit(pgqs_capture_writer_exit, (Datum) 0);
+
+    initStringInfo(&buf);
+
+    elog(LOG, "pg_query_stats: capture writer started");
+
+    for (;;) {
+        (void) WaitLatch(MyLatch,
+                         WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                         100,
+                         PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+
+        CHECK_FOR_INTERRUPTS();
+
+        if (ConfigReloadPending) {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        pgqs_capture_drain(&buf);
+    }
+}
+
+/* Cleanup hook */
+void _PG_fini(void) {
+    ExecutorStart_hook = prev_ExecutorStart;
+    ExecutorRun_hook = prev_ExecutorRun;
+    ExecutorFinish_hook = prev_ExecutorFinish;
+    ExecutorEnd_hook = prev_ExecutorEnd;
+    ProcessUtility_hook = prev_ProcessUtility;
+    emit_log_hook = prev_emit_log_hook;
+
+    UnregisterXactCallback(pgqs_xact_callback, NULL);
+    UnregisterSubXactCallback(pgqs_subxact_callback, NULL);
 
     if (query_times_list)
     {
@@ -0,0 +1,481 @@
+/*
+ * pg_query_stats_replay: replay capture files written by pg_query_stats
+ *
+ * Reads the records of one or more capture files, orders them by start time
+ * and replays them against a target server, one connection per captured
+ * session, keeping the original timing (optionally sped up).  Statements
+ * captured with parameters are sent with the extended protocol, the others
+ * as simple queries.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+#include "libpq-fe.h"
+
+#define CAPTURE_FILE_MAGIC "PGQSCAP1"
+#define CAPTURE_FILE_VERSION 1
+
+typedef struct ReplayParam {
+    int isnull;
+    unsigned int typid;
+    char *value;
+} ReplayParam;
+
+typedef struct ReplayRecord {
+    int64_t start_time;         /* microseconds, server clock */
+    int32_t pid;
+    int64_t session_start;
+    unsigned int dbid;
+    uint64_t queryid;
+    double duration;            /* milliseconds, as captured */
+    int truncated;
+    char *text;
+    int nparams;
+    ReplayParam *params;
+    long order;                 /* position in the input, for a stable sort */
+    struct ReplayRecord *next;  /* pending in its session */
+} ReplayRecord;
+
+typedef struct ReplaySession {
+    int32_t pid;
+    int64_t session_start;
+    PGconn *conn;
+    int busy;
+    ReplayRecord *head;         /* due, waiting for the connection */
+    ReplayRecord *tail;
+} ReplaySession;
+
+static ReplayRecord *records = NULL;
+static long nrecords = 0;
+static long records_size = 0;
+
+static ReplaySession *sessions = NULL;
+static int nsessions = 0;
+static int sessions_size = 0;
+
+static const char *conninfo = "";
+static double speed = 1.0;
+static long dbid_filter = -1;
+
+static long sent = 0;
+static long failed = 0;
+static long skipped = 0;
+static double total_lag = 0;
+static double max_lag = 0;
+
+static void fatal(const char *fmt, const char *arg)
+{
+    fprintf(stderr, "pg_query_stats_replay: ");
+    fprintf(stderr, fmt, arg);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size ? size : 1);
+
+    if (!p)
+        fatal("%s", "out of memory");
+    return p;
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (!p)
+        fatal("%s", "out of memory");
+    return p;
+}
+
+static int64_t now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Big-endian readers over a bounded buffer; fail on a short record */
+typedef struct Reader {
+    const unsigned char *p;
+    const unsigned char *end;
+    const char *file;
+} Reader;
+
+static const unsigned char *take(Reader *r, size_t len)
+{
+    const unsigned char *p = r->p;
+
+    if ((size_t) (r->end - r->p) < len)
+        fatal("truncated record in \"%s\"", r->file);
+    r->p += len;
+    return p;
+}
+
+static uint64_t get_uint(Reader *r, int bytes)
+{
+    const unsigned char *p = take(r, bytes);
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < bytes; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static char *get_text(Reader *r, size_t len)
+{
+    char *s = xmalloc(len + 1);
+
+    memcpy(s, take(r, len), len);
+    s[len] = '\0';
+    return s;
+}
+
+static void parse_record(Reader *r, ReplayRecord *rec)
+{
+    uint64_t bits;
+    int i;
+
+    rec->start_time = (int64_t) get_uint(r, 8);
+    rec->pid = (int32_t) get_uint(r, 4);
+    rec->session_start = (int64_t) get_uint(r, 8);
+    rec->dbid = (unsigned int) get_uint(r, 4);
+    rec->queryid = get_uint(r, 8);
+    bits = get_uint(r, 8);
+    memcpy(&rec->duration, &bits, sizeof(bits));
+    rec->truncated = get_uint(r, 2) & 1;
+    rec->text = get_text(r, get_uint(r, 2));
+    rec->nparams = (int) get_uint(r, 2);
+    rec->params = xmalloc(sizeof(ReplayParam) * rec->nparams);
+
+    for (i = 0; i < rec->nparams; i++) {
+        rec->params[i].isnull = (int) get_uint(r, 1);
+        rec->params[i].typid = (unsigned int) get_uint(r, 4);
+        rec->params[i].value = get_text(r, get_uint(r, 2));
+    }
+    rec->next = NULL;
+}
+
+static void load_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    unsigned char header[12];
+    unsigned char lenbuf[4];
+    Reader r;
+
+    if (!f)
+        fatal("could not open \"%s\"", path);
+
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) ||
+        memcmp(header, CAPTURE_FILE_MAGIC, strlen(CAPTURE_FILE_MAGIC)) != 0)
+        fatal("\"%s\" is not a capture file", path);
+
+    r.p = header + strlen(CAPTURE_FILE_MAGIC);
+    r.end = header + sizeof(header);
+    r.file = path;
+    if (get_uint(&r, 4) != CAPTURE_FILE_VERSION)
+        fatal("unsupported capture file version in \"%s\"", path);
+
+    while (fread(lenbuf, 1, sizeof(lenbuf), f) == sizeof(lenbuf)) {
+        uint32_t len = ((uint32_t) lenbuf[0] << 24) | ((uint32_t) lenbuf[1] << 16) |
+                       ((uint32_t) lenbuf[2] << 8) | lenbuf[3];
+        unsigned char *buf = xmalloc(len);
+        ReplayRecord *rec;
+
+        /* A record cut short by a crash of the writer ends the file */
+        if (fread(buf, 1, len, f) != len) {
+            free(buf);
+            break;
+        }
+
+        if (nrecords == records_size) {
+            records_size = records_size ? records_size * 2 : 1024;
+            records = xrealloc(records, sizeof(ReplayRecord) * records_size);
+        }
+        rec = &records[nrecords];
+
+        r.p = buf;
+        r.end = buf + len;
+        parse_record(&r, rec);
+        free(buf);
+
+        if (dbid_filter >= 0 && rec->dbid != (unsigned long) dbid_filter)
+            continue;
+        rec->order = nrecords++;
+    }
+
+    fclose(f);
+}
+
+static int record_cmp(const void *a, const void *b)
+{
+    const ReplayRecord *ra = a;
+    const ReplayRecord *rb = b;
+
+    if (ra->start_time != rb->start_time)
+        return ra->start_time < rb->start_time ? -1 : 1;
+    return ra->order < rb->order ? -1 : ra->order > rb->order;
+}
+
+/* The replay session for a captured session, connecting on first use */
+static ReplaySession *get_session(ReplayRecord *rec)
+{
+    ReplaySession *s;
+    int i;
+
+    for (i = 0; i < nsessions; i++) {
+        if (sessions[i].pid == rec->pid && sessions[i].session_start == rec->session_start)
+            return &sessions[i];
+    }
+
+    if (nsessions == sessions_size) {
+        sessions_size = sessions_size ? sessions_size * 2 : 64;
+        sessions = xrealloc(sessions, sizeof(ReplaySession) * sessions_size);
+    }
+    s = &sessions[nsessions++];
+    memset(s, 0, sizeof(*s));
+    s->pid = rec->pid;
+    s->session_start = rec->session_start;
+
+    s->conn = PQconnectdb(conninfo);
+    if (PQstatus(s->conn) != CONNECTION_OK)
+        fatal("could not connect: %s", PQerrorMessage(s->conn));
+
+    return s;
+}
+
+/* Send the next pending statement of an idle session */
+static void send_next(ReplaySession *s, int64_t origin, int64_t first)
+{
+    ReplayRecord *rec = s->head;
+    double lag;
+    int ok;
+
+    if (s->busy || !rec)
+        return;
+
+    s->head = rec->next;
+    if (!s->head)
+        s->tail = NULL;
+
+    if (rec->nparams == 0) {
+        ok = PQsendQuery(s->conn, rec->text);
+    } else {
+        unsigned int *types = xmalloc(sizeof(unsigned int) * rec->nparams);
+        const char **values = xmalloc(sizeof(char *) * rec->nparams);
+        int i;
+
+        for (i = 0; i < rec->nparams; i++) {
+            types[i] = rec->params[i].typid;
+            values[i] = rec->params[i].isnull ? NULL : rec->params[i].value;
+        }
+        ok = PQsendQueryParams(s->conn, rec->text, rec->nparams, types, values,
+                               NULL, NULL, 0);
+        free(types);
+        free(values);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "pg_query_stats_replay: could not send: %s", PQerrorMessage(s->conn));
+        failed++;
+        return;
+    }
+
+    lag = (now_us() - origin - (rec->start_time - first) / speed) / 1000.0;
+    if (lag > 0) {
+        total_lag += lag;
+        if (lag > max_lag)
+            max_lag = lag;
+    }
+
+    s->busy = 1;
+    sent++;
+}
+
+/* Collect the results of a session whose socket is readable */
+static void consume(ReplaySession *s)
+{
+    PGresult *res;
+
+    if (!PQconsumeInput(s->conn))
+        fatal("connection lost: %s", PQerrorMessage(s->conn));
+
+    while (!PQisBusy(s->conn)) {
+        res = PQgetResult(s->conn);
+        if (!res) {
+            s->busy = 0;
+            return;
+        }
+
+        switch (PQresultStatus(res)) {
+            case PGRES_FATAL_ERROR:
+                failed++;
+                break;
+            case PGRES_COPY_IN:
+                PQputCopyEnd(s->conn, "not replayed");
+                break;
+            case PGRES_COPY_OUT: {
+                char *buf;
+                int n;
+
+                while ((n = PQgetCopyData(s->conn, &buf, 1)) > 0)
+                    PQfreemem(buf);
+                if (n == 0) {
+                    /* The rest of the data is not here yet */
+                    PQclear(res);
+                    return;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        PQclear(res);
+    }
+}
+
+static void usage(void)
+{
+    printf("Usage: pg_query_stats_replay [OPTION]... FILE...\n"
+           "Replay pg_query_stats capture files against a server.\n\n"
+           "Options:\n"
+           "  -d CONNINFO  connection string of the target server\n"
+           "  -s FACTOR    speed up (> 1) or slow down (< 1) the replay, default 1\n"
+           "  -D OID       replay only statements of this database oid\n"
+           "  -h           show this help\n");
+}
+
+int main(int argc, char **argv)
+{
+    int64_t origin;
+    int64_t first;
+    long next = 0;
+    int c;
+    int i;
+
+    while ((c = getopt(argc, argv, "d:s:D:h")) != -1) {
+        switch (c) {
+            case 'd':
+                conninfo = optarg;
+                break;
+            case 's':
+                speed = atof(optarg);
+                if (speed <= 0)
+                    fatal("invalid speed factor \"%s\"", optarg);
+                break;
+            case 'D':
+                dbid_filter = atol(optarg);
+                break;
+            case 'h':
+                usage();
+                return 0;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage();
+        return 1;
+    }
+
+    for (i = optind; i < argc; i++)
+        load_file(argv[i]);
+
+    if (nrecords == 0) {
+        printf("no statements to replay\n");
+        return 0;
+    }
+
+    qsort(records, nrecords, sizeof(ReplayRecord), record_cmp);
+
+    first = records[0].start_time;
+    origin = now_us();
+
+    for (;;) {
+        fd_set readable;
+        struct timeval timeout;
+        struct timeval *wait = NULL;
+        int maxfd = -1;
+        int busy = 0;
+
+        /* Hand every due statement to its session */
+        while (next < nrecords) {
+            ReplayRecord *rec = &records[next];
+            ReplaySession *s;
+            int64_t due = origin + (int64_t) ((rec->start_time - first) / speed);
+            int64_t now = now_us();
+
+            if (due > now) {
+                timeout.tv_sec = (due - now) / 1000000;
+                timeout.tv_usec = (due - now) % 1000000;
+                wait = &timeout;
+                break;
+            }
+
+            next++;
+            if (rec->truncated) {
+                skipped++;
+                continue;
+            }
+
+            s = get_session(rec);
+            if (s->tail)
+                s->tail->next = rec;
+            else
+                s->head = rec;
+            s->tail = rec;
+            send_next(s, origin, first);
+        }
+
+        FD_ZERO(&readable);
+        for (i = 0; i < nsessions; i++) {
+            if (sessions[i].busy) {
+                int fd = PQsocket(sessions[i].conn);
+
+                FD_SET(fd, &readable);
+                if (fd > maxfd)
+                    maxfd = fd;
+                busy++;
+            }
+        }
+
+        if (busy == 0 && next >= nrecords)
+            break;
+
+        if (select(maxfd + 1, &readable, NULL, NULL, wait) < 0) {
+            if (errno == EINTR)
+                continue;
+            fatal("select failed: %s", strerror(errno));
+        }
+
+        for (i = 0; i < nsessions; i++) {
+            ReplaySession *s = &sessions[i];
+
+            if (s->busy && FD_ISSET(PQsocket(s->conn), &readable)) {
+                consume(s);
+                send_next(s, origin, first);
+            }
+        }
+    }
+
+    for (i = 0; i < nsessions; i++)
+        PQfinish(sessions[i].conn);
+
+    printf("replayed %ld statements in %.3f s over %d sessions\n",
+           sent, (now_us() - origin) / 1000000.0, nsessions);
+    printf("errors: %ld, skipped (truncated records): %ld\n", failed, skipped);
+    printf("lag: %.3f ms average, %.3f ms maximum\n",
+           sent ? total_lag / sent : 0.0, max_lag);
+
+    return 0;
+}
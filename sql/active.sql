@@ -0,0 +1,10 @@
+--
+-- Statements in flight
+--
+-- Sees the statement calling it
+CREATE FUNCTION pgqs_active_self() RETURNS bigint LANGUAGE sql AS
+$$ SELECT count(*) FROM pg_query_stats_active WHERE pid = pg_backend_pid() $$;
+SELECT pgqs_active_self();
+-- Statements mentioning pg_query_stats are not tracked
+SELECT count(*) FROM pg_query_stats_active WHERE pid = pg_backend_pid();
+DROP FUNCTION pgqs_active_self();
@@ -0,0 +1,12 @@
+--
+-- JSON and Arrow bulk output
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+SELECT v FROM pgqs_t WHERE id = 3;
+SELECT j -> 0 ->> 'query_text' AS query_text, j -> 0 ->> 'calls' AS calls
+FROM (SELECT pg_query_stats_json()::jsonb AS j) s;
+-- An Arrow stream starts with a continuation marker and ends with the
+-- end-of-stream marker
+SELECT substr(a, 1, 4) = '\xffffffff'::bytea AS continuation,
+       substr(a, length(a) - 7) = '\xffffffff00000000'::bytea AS end_of_stream
+FROM (SELECT pg_query_stats_arrow() AS a) s;
@@ -0,0 +1,10 @@
+--
+-- Workload capture: statements queued for the capture writer
+--
+SELECT captured AS captured_before FROM pg_query_stats_capture_info() \gset
+SET pg_query_stats.capture = on;
+SELECT v FROM pgqs_t WHERE id = 1;
+SELECT v FROM pgqs_t WHERE id = 2;
+SET pg_query_stats.capture = off;
+-- The two statements and the SET that enabled capture
+SELECT captured - :captured_before AS captured, dropped FROM pg_query_stats_capture_info();
@@ -0,0 +1,7 @@
+--
+-- Rows and bytes sent to the client
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+SET pg_query_stats.track_client_send = on;
+SELECT id FROM pgqs_t WHERE id <= 3 ORDER BY id;
+SELECT calls, send_calls, rows_sent, bytes_sent FROM pg_query_stats_client_send;
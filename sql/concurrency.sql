@@ -0,0 +1,8 @@
+--
+-- Concurrency at start; the first execution creates the entry
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+SELECT v FROM pgqs_t WHERE id = 1;
+SELECT v FROM pgqs_t WHERE id = 1;
+SELECT v FROM pgqs_t WHERE id = 1;
+SELECT calls, inflight, peak_concurrency, hist_calls FROM pg_query_stats_concurrency;
@@ -0,0 +1,15 @@
+--
+-- Row estimate q-error per statement and relation
+--
+-- a and b are correlated, so a = 1 AND b = 1 matches ten times the
+-- estimated rows
+CREATE TABLE pgqs_corr AS SELECT g % 10 AS a, g % 10 AS b FROM generate_series(1, 1000) g;
+ANALYZE pgqs_corr;
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+SET pg_query_stats.plan_sample_rate = 1;
+SELECT count(*) FROM pgqs_corr WHERE a = 1 AND b = 1;
+SELECT calls, sampled_calls, round(max_qerror) AS max_qerror
+FROM pg_query_stats_estimates;
+SELECT relation, scans, round(max_qerror) AS max_qerror
+FROM pg_query_stats_relation_estimates;
+DROP TABLE pgqs_corr;
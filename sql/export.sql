@@ -0,0 +1,16 @@
+--
+-- Export and merge
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+SELECT v FROM pgqs_t WHERE id = 1;
+SELECT v FROM pgqs_t WHERE id = 1;
+SELECT v FROM pgqs_t WHERE id = 2;
+CREATE TEMP TABLE pgqs_export AS SELECT pg_query_stats_export() AS e;
+-- Merging an export with itself doubles every counter
+SELECT query_text, sources, calls
+FROM pg_query_stats_merge((SELECT ARRAY[e, e] FROM pgqs_export))
+ORDER BY query_text;
+SELECT * FROM pg_query_stats_merge(ARRAY['\x00'::bytea]);
+-- An entry count the payload cannot hold
+SELECT * FROM pg_query_stats_merge((SELECT ARRAY[overlay(e placing '\x7fffffff'::bytea from 13 for 4)] FROM pgqs_export));
+SELECT has_function_privilege('public', 'pg_query_stats_merge(bytea[])', 'execute') AS public_merge;
@@ -0,0 +1,17 @@
+--
+-- Executions ended by an error
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+SELECT 1 / (id - 1) FROM pgqs_t WHERE id = 1;
+SELECT sqlstate, kind, failures FROM pg_query_stats_failures;
+-- A statement that failed and then succeeded shares one stored text
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+CREATE TEMP TABLE pgqs_e (a int);
+SELECT 10 / count(*) AS q FROM pgqs_e;
+INSERT INTO pgqs_e VALUES (1);
+SELECT 10 / count(*) AS q FROM pgqs_e;
+SELECT f.failures, s.calls, f.query_text = s.query_text AS same_text
+FROM pg_query_stats_failures f
+JOIN pg_query_stats s USING (queryid);
+SELECT entries, texts FROM pg_query_stats_info();
+DROP TABLE pgqs_e;
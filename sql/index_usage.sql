@@ -0,0 +1,7 @@
+--
+-- Indexes used by each statement's plan
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+SET pg_query_stats.track_indexes = on;
+SELECT v FROM pgqs_t WHERE id = 42;
+SELECT index, relation, calls, query_text FROM pg_query_stats_index_usage;
@@ -0,0 +1,10 @@
+--
+-- JIT compilation cost; statements show up only where JIT is available
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+SET jit = on;
+SET jit_above_cost = 0;
+SELECT sum(id) FROM pgqs_t;
+SELECT count(*) = pg_jit_available()::int AS ok
+FROM pg_query_stats_jit
+WHERE jit_calls = 1 AND jit_functions > 0;
@@ -0,0 +1,11 @@
+--
+-- Parallel plans
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+SELECT count(*) FROM pgqs_t;
+SELECT calls, parallel_calls, workers_planned > 0 AS planned_workers
+FROM pg_query_stats_parallel;
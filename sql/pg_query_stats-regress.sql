@@ -0,0 +1,15 @@
+--
+-- pg_query_stats regression tests: installation and the table the
+-- other tests query
+--
+
+-- Install 1.0.0 and update, to run the upgrade script
+CREATE EXTENSION pg_query_stats VERSION '1.0.0';
+ALTER EXTENSION pg_query_stats UPDATE TO '1.1';
+SELECT extversion FROM pg_extension WHERE extname = 'pg_query_stats';
+DROP EXTENSION pg_query_stats;
+CREATE EXTENSION pg_query_stats;
+
+CREATE TABLE pgqs_t (id int PRIMARY KEY, v text);
+INSERT INTO pgqs_t SELECT g, 'v' || g FROM generate_series(1, 1000) g;
+ANALYZE pgqs_t;
@@ -0,0 +1,26 @@
+--
+-- Generic and custom cached plans of prepared statements
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+PREPARE pgqs_q(int) AS SELECT v FROM pgqs_t WHERE id = $1;
+-- The first five executions are planned with their parameters
+EXECUTE pgqs_q(1);
+EXECUTE pgqs_q(2);
+EXECUTE pgqs_q(3);
+EXECUTE pgqs_q(4);
+EXECUTE pgqs_q(5);
+SELECT calls, generic_calls, custom_calls FROM pg_query_stats_plan_cache;
+DEALLOCATE pgqs_q;
+-- plan_cache_mode decides which kind of plan runs
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+PREPARE pgqs_q2(int) AS SELECT v FROM pgqs_t WHERE id = $1;
+SET plan_cache_mode = force_custom_plan;
+EXECUTE pgqs_q2(1);
+EXECUTE pgqs_q2(2);
+SET plan_cache_mode = force_generic_plan;
+EXECUTE pgqs_q2(3);
+EXECUTE pgqs_q2(4);
+EXECUTE pgqs_q2(5);
+SELECT calls, generic_calls, custom_calls FROM pg_query_stats_plan_cache;
+RESET plan_cache_mode;
+DEALLOCATE pgqs_q2;
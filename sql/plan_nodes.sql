@@ -0,0 +1,9 @@
+--
+-- Time profile per plan node type of sampled executions
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+SET pg_query_stats.plan_sample_rate = 1;
+SELECT count(*) FROM pgqs_t;
+SELECT node_type, relation, calls, loops, rows
+FROM pg_query_stats_plan_nodes
+ORDER BY node_type;
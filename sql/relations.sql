@@ -0,0 +1,7 @@
+--
+-- Time and buffers per referenced relation
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+SET pg_query_stats.track_relations = on;
+SELECT v FROM pgqs_t WHERE id = 5;
+SELECT relation, calls FROM pg_query_stats_relations;
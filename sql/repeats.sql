@@ -0,0 +1,15 @@
+--
+-- Statements repeated within a transaction
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+BEGIN;
+SELECT v FROM pgqs_t WHERE id = 2;
+SELECT v FROM pgqs_t WHERE id = 2;
+SELECT v FROM pgqs_t WHERE id = 2;
+COMMIT;
+SELECT calls, xacts, round_trips, extra_round_trips FROM pg_query_stats_repeats;
+-- A loop in a DO block runs on the server: no round trips
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+DO $$ BEGIN FOR i IN 1..3 LOOP PERFORM v FROM pgqs_t WHERE id = i; END LOOP; END $$;
+SELECT calls FROM pg_query_stats WHERE query_text LIKE '%FROM pgqs_t WHERE id = i';
+SELECT count(*) FROM pg_query_stats_repeats;
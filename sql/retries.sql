@@ -0,0 +1,13 @@
+--
+-- Serialization failures and the transactions retrying them
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+SET pg_query_stats.retry_window = '1min';
+BEGIN;
+SELECT v FROM pgqs_t WHERE id = 7;
+DO $$ BEGIN RAISE EXCEPTION 'could not serialize' USING ERRCODE = 'serialization_failure'; END $$;
+ROLLBACK;
+BEGIN;
+SELECT v FROM pgqs_t WHERE id = 7;
+COMMIT;
+SELECT calls, commits, aborts, serialization_failures, retries FROM pg_query_stats_xacts;
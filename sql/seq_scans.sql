@@ -0,0 +1,8 @@
+--
+-- Filtered Seq Scans and the indexes they suggest
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+SET pg_query_stats.plan_sample_rate = 1;
+SELECT v FROM pgqs_t WHERE v = 'v42';
+SELECT relation, columns, seq_scans, rows_returned, rows_removed, suggestion
+FROM pg_query_stats_index_candidates;
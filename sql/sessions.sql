@@ -0,0 +1,13 @@
+--
+-- Session and per-application totals
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+SELECT v FROM pgqs_t WHERE id = 1;
+SELECT v FROM pgqs_t WHERE id = 2;
+SELECT statements, rows FROM pg_query_stats_sessions WHERE pid = pg_backend_pid();
+SELECT sessions, active_sessions, statements
+FROM pg_query_stats_applications
+WHERE application_name = current_setting('application_name');
+-- SQL run by a DO block is not a statement of the session
+DO $$ BEGIN PERFORM v FROM pgqs_t WHERE id = 1; PERFORM v FROM pgqs_t WHERE id = 2; END $$;
+SELECT statements, rows FROM pg_query_stats_sessions WHERE pid = pg_backend_pid();
@@ -0,0 +1,10 @@
+--
+-- Sorts and hashes spilled to temp files
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+SET pg_query_stats.plan_sample_rate = 1;
+SET work_mem = '64kB';
+SELECT g FROM generate_series(1, 20000) g ORDER BY g DESC OFFSET 19999;
+SELECT calls, spill_calls, temp_blks_written > 0 AS wrote_temp,
+       suggested_work_mem_kb > 64 AS suggests_more
+FROM pg_query_stats_spills;
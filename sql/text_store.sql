@@ -0,0 +1,9 @@
+--
+-- Shared, compressed statement texts
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+DO $$ BEGIN EXECUTE format('SELECT %L IS NOT NULL', repeat('a', 2000)); END $$;
+DO $$ BEGIN EXECUTE format('SELECT %L IS NOT NULL', repeat('a', 2000)); END $$;
+SELECT calls, length(query_text) FROM pg_query_stats;
+SELECT entries, max_entries, texts, bytes_saved > 1500 AS compressed FROM pg_query_stats_info();
+SELECT texts_truncated FROM pg_query_stats_info();
@@ -0,0 +1,10 @@
+--
+-- Wait profile from the wait sampler
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+SELECT pg_sleep(0.5);
+SELECT wait_event_type, wait_event
+FROM pg_query_stats_waits
+WHERE query_text LIKE 'SELECT pg_sleep%'
+ORDER BY samples DESC
+LIMIT 1;
@@ -0,0 +1,27 @@
+--
+-- Workload mix by command type, command tag and database
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+SELECT v FROM pgqs_t WHERE id = 1;
+SELECT v FROM pgqs_t WHERE id = 2;
+UPDATE pgqs_t SET v = v WHERE id = 1;
+CREATE TEMP TABLE pgqs_w (a int);
+DROP TABLE pgqs_w;
+SELECT kind, name, calls
+FROM pg_query_stats_workload
+WHERE kind <> 'database'
+ORDER BY kind, name;
+SELECT calls FROM pg_query_stats_workload
+WHERE kind = 'database' AND name = current_database();
+-- Plans run by a utility count under its command tag only
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+PREPARE pgqs_wq(int) AS SELECT v FROM pgqs_t WHERE id = $1;
+EXECUTE pgqs_wq(1);
+DO $$ BEGIN PERFORM v FROM pgqs_t WHERE id = 1; END $$;
+CREATE TEMP TABLE pgqs_ctas AS SELECT * FROM pgqs_t WHERE id < 3;
+SELECT kind, name, calls
+FROM pg_query_stats_workload
+WHERE kind <> 'database'
+ORDER BY kind, name;
+DEALLOCATE pgqs_wq;
+DROP TABLE pgqs_ctas;
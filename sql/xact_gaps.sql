@@ -0,0 +1,12 @@
+--
+-- Client think-time between the statements of a transaction
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+BEGIN;
+UPDATE pgqs_t SET v = v WHERE id = 1;
+SELECT v FROM pgqs_t WHERE id = 1;
+COMMIT;
+SELECT g.xacts, g.gaps
+FROM pg_query_stats_xact_gaps g
+JOIN pg_query_stats_xacts x USING (xact_fingerprint)
+WHERE x.nstatements = 2;
@@ -0,0 +1,17 @@
+--
+-- Transactions per shape
+--
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+BEGIN;
+UPDATE pgqs_t SET v = v WHERE id = 1;
+SELECT v FROM pgqs_t WHERE id = 1;
+COMMIT;
+SELECT nstatements, calls, commits, aborts,
+       statements[1] = (SELECT queryid FROM pg_query_stats WHERE query_text LIKE 'UPDATE%') AS update_first
+FROM pg_query_stats_xacts;
+-- SQL run by a DO block is part of the DO, not of the transaction's shape
+SELECT pg_query_stats_reset() IS NOT NULL AS ok;
+BEGIN;
+DO $$ BEGIN PERFORM v FROM pgqs_t WHERE id = 1; PERFORM v FROM pgqs_t WHERE id = 2; END $$;
+COMMIT;
+SELECT count(*) FROM pg_query_stats_xacts;